@@ -1,5 +1,9 @@
 // binplay.c
 
+#ifdef DEBUG
+  #define _GNU_SOURCE // RTLD_NEXT, for the real-time self-check
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -10,6 +14,27 @@
 #include <unistd.h> // read
 #include <string.h> // strlen
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdalign.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#ifdef DEBUG
+  #include <dlfcn.h>
+#endif
 
 #include <portaudio.h>
 
@@ -18,7 +43,7 @@
 
 #define PROG "binplay"
 #define CC "gcc"
-#define C_FLAGS "-O3 -pedantic -lportaudio"
+#define C_FLAGS "-O3 -pedantic -lportaudio -lpthread -lm"
 
 enum Keys {
   KeyNone = 0,
@@ -28,10 +53,72 @@ enum Keys {
   KeyToggleLoop = 'l',
   KeyTogglePause = 32, // Spacebar
   KeyToggleHelp = '\t',
+  KeyNextHighEntropy = 'h',
+  KeyNextLowEntropy = 'j',
+  KeyNextText = 't',
+  KeySetCue = 'c',
+  KeyMarkA = 'a',
+  KeyMarkB = 'b',
+  KeyClearMarks = 'x',
 
   MaxKey,
 };
 
+typedef enum Engine {
+  EngineCallback = 0, // PortAudio pulls buffers through stereo_callback()
+  EngineBlocking,     // a writer thread pushes blocks with Pa_WriteStream()
+} Engine;
+
+static const char* engine_desc[] = {
+  "callback",
+  "blocking",
+};
+
+typedef enum Huge_pages {
+  HugePagesOff = 0,
+  HugePagesTransparent, // madvise(MADV_HUGEPAGE), the kernel backs what it can
+  HugePagesExplicit,    // MAP_HUGETLB, needs pages reserved in /proc/sys/vm/nr_hugepages
+} Huge_pages;
+
+static const char* huge_pages_desc[] = {
+  "off",
+  "transparent",
+  "explicit",
+};
+
+// Sections of the status panel, in display order
+typedef enum Info_field {
+  InfoPlaying = 0,
+  InfoMix,
+  InfoProgress,
+  InfoRegion,
+  InfoVolume,
+  InfoFormat,
+  InfoOutput,
+  InfoEngine,
+  InfoXruns,
+  InfoReadAhead,
+  InfoRealtime,
+  InfoProcessTime,
+  InfoPrefetch,
+
+  MaxInfoField,
+} Info_field;
+
+typedef enum Rt_status {
+  RtOff = 0,
+  RtFifo,   // got SCHED_FIFO
+  RtNice,   // real-time scheduling was denied, got a raised nice value instead
+  RtDenied,
+} Rt_status;
+
+static const char* rt_status_desc[] = {
+  "off",
+  "SCHED_FIFO",
+  "nice -10",
+  "denied",
+};
+
 static const char* key_code_desc[] = {
   " KEY          DESCRIPTION",
   " [^D]       - exit",
@@ -40,11 +127,46 @@ static const char* key_code_desc[] = {
   " [L]        - toggle (l)oop",
   " [SPACEBAR] - toggle pause",
   " [TAB]      - toggle help menu",
+  " [H]        - jump to the next (h)igh entropy block",
+  " [J]        - jump to the next low entropy block",
+  " [T]        - jump to the next (t)ext-like block",
+  " [C]        - set a (c)ue point at the cursor",
+  " [1-9, 0]   - jump to cue 1 to 10",
+  " [A], [B]   - set the start and end of the loop region",
+  " [X]        - clear the loop region",
 };
 
+typedef enum Block_kind {
+  BlockHighEntropy = 0,
+  BlockLowEntropy,
+  BlockText,
+} Block_kind;
+
+// Everything that changes playback, whether it comes from a key or a line of text
+typedef enum Command_type {
+  CommandNone = 0,
+  CommandPlay,
+  CommandPause,
+  CommandTogglePause,
+  CommandLoop,      // amount: 0 off, 1 on, -1 toggle
+  CommandSeek,      // offset: byte offset into the file
+  CommandSeekBy,    // offset: bytes relative to the cursor
+  CommandVolume,    // amount: new volume
+  CommandVolumeBy,  // amount: added to the volume
+  CommandJump,      // offset: Block_kind to jump to
+  CommandCue,       // offset: index of the cue to jump to
+  CommandSetCue,
+  CommandRegion,    // offset to end: loop region, a negative offset clears it
+  CommandStatus,
+  CommandQuit,
+} Command_type;
+
+
 typedef double f64;
 typedef float f32;
 typedef int32_t i32;
+typedef int64_t i64;
+typedef uint64_t u64;
 typedef uint32_t u32;
 typedef int16_t i16;
 typedef uint16_t u16;
@@ -57,52 +179,966 @@ typedef uint8_t u8;
 #define MAX_FILE_SIZE     512
 
 #define FRAMES_PER_BUFFER 512
+// upper bound on the frames handled per chunk when the host decides the buffer size
+#define MAX_FRAMES_PER_BUFFER 4096
+// largest block the writer thread renders and pushes in one Pa_WriteStream() call
+#define WRITE_BLOCK_FRAMES 16384
 #define SAMPLE_RATE       44100
 #define SAMPLE_SIZE       2
 #define CHANNEL_COUNT     2
 
-#define INFO_BUFFER_SIZE 512
+#define INFO_BUFFER_SIZE 2048
+#define INFO_LINE_SIZE 320
+#define MAX_INFO_INPUTS 8
+// how often the status panel is refreshed when nothing else happens
+#define UI_REFRESH_INTERVAL_MS 1000
+
+// how many of the most recent xruns we remember the file offset of
+#define MAX_XRUN_EVENTS 16
+
+// log-linear histogram of processing times: 2^PROFILE_SUB_BITS buckets per power of two
+// nanoseconds, which keeps the relative error of every bucket below ~6%
+#define PROFILE_SUB_BITS 4
+#define PROFILE_SUB_BUCKETS (1 << PROFILE_SUB_BITS)
+#define PROFILE_MAX_EXPONENT 40
+#define PROFILE_BUCKETS ((PROFILE_MAX_EXPONENT - PROFILE_SUB_BITS + 2) * PROFILE_SUB_BUCKETS)
+
+#define RT_PRIORITY_AUDIO 70
+#define RT_PRIORITY_READER 60
+// stack the audio thread touches up front so it never page faults on it
+#define PREFAULT_STACK_SIZE (64 * 1024)
+
+#define MAX_SOURCES 64
+// read-ahead ring per source, filled by the reader thread (must be a power of two)
+#define READ_AHEAD_SIZE (1 << 20)
+#define READ_CHUNK_SIZE (64 * 1024)
+// already played bytes the reader leaves alone, so the hex view can show them
+#define READ_BEHIND_SIZE (4 * 1024)
+// longest the idle reader sleeps without being woken, in nanoseconds
+#define READER_IDLE_NS 1000000000LL
+
+// whole-file overview: min/max pyramid from WAVEFORM_BASE_BINS bins down to
+// WAVEFORM_BASE_BINS >> (WAVEFORM_LEVELS - 1), drawn with braille (2x4 dots per cell)
+#define WAVEFORM_BASE_BINS 8192
+#define WAVEFORM_LEVELS 7
+#define WAVEFORM_COLUMNS 80
+#define WAVEFORM_ROWS 4
+#define WAVEFORM_PROBE_SIZE 4096
+#define WAVEFORM_SCAN_CHUNK (256 * 1024)
+#define WAVEFORM_TEXT_SIZE ((WAVEFORM_COLUMNS * 3 + 1) * (WAVEFORM_ROWS + 2) + 64)
+
+// live spectrogram of the rendered output
+#define SPECTRUM_RING_SIZE (1 << 16) // mono samples between the audio thread and the fft worker
+#define SPECTRUM_FFT_SIZE 1024
+#define SPECTRUM_MIN_FREQ 40.0f
+#define SPECTRUM_FLOOR_DB -90.0f
+#define SPECTRUM_IDLE_SLEEP 0.1 // longest the worker sleeps while nothing is tapped, in seconds, well below what the ring holds
+#define SPECTROGRAM_ROWS 8
+#define SPECTROGRAM_COLUMNS 80
+#define SPECTROGRAM_TEXT_SIZE ((SPECTROGRAM_COLUMNS + 1) * SPECTROGRAM_ROWS + 64)
+
+// level meters, computed on the audio thread
+#define METER_CHANNELS 8 // channels past this aren't metered
+#define METER_WIDTH 60
+#define METER_FLOOR_DB -60.0f
+#define METER_RMS_SECONDS 0.3f     // integration time of the rms average
+#define METER_PEAK_DECAY_DB 20.0f  // per second
+#define METER_HOLD_NS 1500000000ULL
+#define METER_CLIP_NS 3000000000ULL // how long the clip indicator stays lit
+#define METER_TEXT_SIZE (METER_CHANNELS * (METER_WIDTH + 32) + 32)
+
+// hex view around the play cursor
+#define HEX_BYTES_PER_ROW 16
+#define HEX_ROWS 8
+#define HEX_ROWS_BEFORE 2 // rows shown before the one holding the cursor
+#define HEX_ROW_WIDTH (2 + 10 + 2 + 3 * HEX_BYTES_PER_ROW + 1 + HEX_BYTES_PER_ROW + 1 + 1)
+#define HEX_TEXT_SIZE (HEX_ROW_WIDTH * HEX_ROWS + 1)
+
+// block index: entropy, zero and printable ratio per block, computed by a pool of workers
+#define INDEX_BLOCK_SIZE (64 * 1024)
+#define INDEX_BATCH_BLOCKS 16 // blocks a worker takes at a time
+#define MAX_INDEX_WORKERS 8
+#define INDEX_COLUMNS 80
+#define INDEX_TEXT_SIZE ((INDEX_COLUMNS * 3 + 1) * 2 + 192)
+#define HIGH_ENTROPY 7.2f // bits per byte, compressed or encrypted data
+#define LOW_ENTROPY 2.0f
+
+// longest line accepted as a command in headless mode
+#define MAX_COMMAND_LINE_SIZE 256
+// commands in flight from the ui to the audio thread, must be a power of two
+#define COMMAND_QUEUE_SIZE 64
+#define CACHE_LINE_SIZE 64
+// session arena, see binplay_arena_size()
+#define ARENA_ALIGN CACHE_LINE_SIZE
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+// stdio buffer of the headless status output
+#define STATUS_BUFFER_SIZE (64 * 1024)
+// remote control over a unix domain socket
+#define MAX_CONTROL_CLIENTS 64
+#define MAX_STATUS_SIZE 512
+
+// cue points, the start of each is kept in memory to jump there without waiting on the disk
+#define MAX_CUES 10
+#define CUE_PREFETCH_MS 500
+#define CUE_TEXT_SIZE (MAX_CUES * 64 + 32)
+
+// likely seek targets kept in memory by the prefetcher
+#define PREFETCH_SLOTS 8
+#define PREFETCH_WINDOW_MS 2000
+#define PREFETCH_MARGIN_MS 500    // a slot only counts for a target with this much audio after it
+#define PREFETCH_INTERVAL_US 50000
+#define SEEK_HISTORY 8            // recent seek steps the prefetcher learns from
+
+// waveform and block index of files seen before, kept in $XDG_CACHE_HOME/binplay
+#define ANALYSIS_CACHE_DIR "binplay"
+#define ANALYSIS_CACHE_MAGIC "BPAC"
+#define ANALYSIS_CACHE_VERSION 1
+
+// batch rendering of many files to wav, see batch_run()
+#define BATCH_CHUNK_SIZE (4 * 1024 * 1024) // tasks are split down to chunks of this much input
+#define BATCH_BLOCK_SIZE (256 * 1024)      // input read and rendered at a time
+#define BATCH_BLOCK_FRAMES 16384
+#define BATCH_DEQUE_SIZE 64                // tasks per worker, must be a power of two
+#define BATCH_MAX_OPEN_FILES 64            // at most 255, the slot of a task has 8 bits
+#define BATCH_MAX_WORKERS 64
+#define BATCH_IDLE_US 200
+#define BATCH_WAV_HEADER_SIZE 80
+
+// corpus features, computed over the batch pool, see feature_finish()
+#define FEATURE_FFT_SIZE 1024
+#define FEATURE_BANDS 8                     // log spaced from the first bin to nyquist
+#define FEATURE_DIMS (FEATURE_BANDS + 4)    // bands, centroid, flatness, level, entropy
+#define FEATURE_INDEX_MAGIC "BPFI"
+#define FEATURE_INDEX_VERSION 1
 
-// skip first 44 bytes when loading wav files (minimal length of wavefront header)
-#define SKIP_44
+#define DEVICE_CACHE_FILE ".binplay_devices"
+#define MAX_DEVICE_CACHE_ENTRIES 1024
+#define MAX_DEVICE_NAME_SIZE 128
 
 i32 g_frames_per_buffer = 512;
-i32 g_sample_rate = SAMPLE_RATE;
-i32 g_sample_size = 2;
-i32 g_channel_count = CHANNEL_COUNT;
+// 0 until the header of the file (or the command line) decides, see binplay_init()
+i32 g_sample_rate = 0;
+i32 g_sample_size = 0;
+i32 g_channel_count = 0;
 f32 g_volume = 1.0f;
 i32 g_cursor_speed = 10 * SAMPLE_RATE * SAMPLE_SIZE * CHANNEL_COUNT;
 i32 g_loop_after_complete = 1;
+i32 g_low_latency = 0;
+f32 g_latency_ms = 0.0f; // 0 means use the latency profile of the output device
+Engine g_engine = EngineCallback;
+char* g_profile_path = NULL; // where to dump the processing time histogram on exit
+char* g_device = NULL; // index or name of the output device, NULL for the default device
+i32 g_list_devices = 0;
+char* g_mix = NULL; // additional sources to mix in, see source_parse_spec()
+i32 g_spectrogram_fps = 15;
+i32 g_fft_hop = 256;
+i32 g_realtime = 0;
+i32 g_huge_pages = HugePagesOff;
+i32 g_headless = 0;
+char* g_status_path = NULL; // where headless mode writes status lines, NULL for stdout
+char* g_control_path = NULL; // unix socket to accept remote control connections on
+char* g_cue_path = NULL; // file with one cue offset per line
+char* g_offset = NULL; // only play from this offset into the data
+char* g_length = NULL; // only play this many bytes
+f32 g_status_rate = 1.0f;   // status lines per second in headless mode
+i32 g_progress_step = 1;    // seconds the progress line moves in, larger steps redraw the ui less often
+i32 g_analysis_cache = 1;
+char* g_batch_path = NULL; // file list or directory to render in batch mode
+char* g_batch_output = ".";
+i32 g_jobs = 0;
+char* g_feature_index = NULL; // where --batch writes feature vectors and --query searches them
+char* g_query_path = NULL;
+i32 g_neighbours = 10;
+volatile sig_atomic_t g_stop_requested = 0;
+
+typedef struct Command {
+  Command_type type;
+  i64 offset;
+  i64 end;
+  f32 amount;
+} Command;
+
+// Single producer (the ui thread), single consumer (the audio thread). The indices live on
+// their own cache lines so the two sides don't invalidate each other on every push and pop.
+typedef struct Command_queue {
+  alignas(CACHE_LINE_SIZE) atomic_uint head;
+  alignas(CACHE_LINE_SIZE) atomic_uint tail;
+  atomic_uint dropped;  // pushes that found the queue full
+  alignas(CACHE_LINE_SIZE) Command slots[COMMAND_QUEUE_SIZE];
+} Command_queue;
+
+// Playback state owned by the audio thread, changed only through the command queue
+typedef struct Audio_state {
+  alignas(CACHE_LINE_SIZE) u8 play;
+  u8 loop;
+  u8 region;  // looping between the A and B markers
+  f32 volume;
+} Audio_state;
+
+typedef enum Xrun_kind {
+  XrunUnderflow = 0,
+  XrunOverflow,
+} Xrun_kind;
+
+// Written from the audio thread, read from the ui thread, so everything here is atomic.
+// Each event packs the kind into the top bit and the file offset into the rest.
+typedef struct Xrun_stats {
+  atomic_uint underflows;
+  atomic_uint overflows;
+  atomic_uint event_count;
+  _Atomic u64 events[MAX_XRUN_EVENTS];
+} Xrun_stats;
+
+// Processing time of every binplay_process_audio() call. Recorded from the audio thread with
+// relaxed atomics only, read by the ui thread at any time.
+typedef struct Profile {
+  atomic_uint buckets[PROFILE_BUCKETS];
+  atomic_ullong count;
+  atomic_ullong total_ns;
+  atomic_ullong max_ns;
+  atomic_ullong frames;
+} Profile;
+
+// A section of the status panel together with the values it was last formatted from,
+// so that it is only reformatted when one of them changes
+typedef struct Info_line {
+  u64 inputs[MAX_INFO_INPUTS];
+  u8 valid;
+  u32 length;
+  char text[INFO_LINE_SIZE];
+} Info_line;
+
+typedef enum Bin_state {
+  BinEmpty = 0,
+  BinEstimate, // from a probe of a few kilobytes
+  BinExact,
+} Bin_state;
+
+// All buffers of a playback session, carved out of one mapping made (and faulted in) before
+// any thread starts. Nothing is given back until the session ends, so pushing is a bump of
+// `used`. Only the main thread pushes.
+typedef struct Arena {
+  u8* base;
+  u64 size;
+  u64 used;
+  Huge_pages huge_pages; // what the mapping actually got
+} Arena;
+
+// Min/max pyramid over the sample data of the first source. Built by a worker thread:
+// first a rough probe of every bin on the level that is on screen, then an exact scan of
+// the base level that is merged upwards as it goes. Each bin packs min and max (as 16 bit
+// samples) into one atomic so the ui never sees half a bin.
+typedef struct Waveform {
+  _Atomic u32 bins[2 * WAVEFORM_BASE_BINS];
+  atomic_uchar state[2 * WAVEFORM_BASE_BINS];
+  atomic_uint revision;     // bumped whenever bins were updated
+  atomic_uint bins_scanned; // base bins done by the exact scan
+  pthread_t worker;
+  u8 worker_running;
+  u8* buffer;               // WAVEFORM_SCAN_CHUNK bytes for the worker
+  u32 rendered_revision;
+  i32 rendered_column;
+  u8 rendered;
+  char text[WAVEFORM_TEXT_SIZE];
+} Waveform;
+
+// Mono mix of the rendered output goes from the audio thread into `ring` (single producer,
+// single consumer, no locks). A worker runs a windowed fft every `g_fft_hop` samples and
+// scrolls one column into `history` per frame.
+typedef struct Spectrogram {
+  f32 ring[SPECTRUM_RING_SIZE];
+  atomic_uint head;
+  atomic_uint tail;
+  atomic_uint dropped;  // samples the worker didn't keep up with
+  atomic_uchar history[SPECTROGRAM_COLUMNS][SPECTROGRAM_ROWS];
+  atomic_uint columns;  // columns written so far
+  pthread_t worker;
+  u8 worker_running;
+  f32* window;          // the last SPECTRUM_FFT_SIZE samples
+  void* fft_memory;     // fft_memory_size(SPECTRUM_FFT_SIZE) bytes
+  u32 rendered_columns;
+  u8 rendered;
+  char text[SPECTROGRAM_TEXT_SIZE];
+} Spectrogram;
+
+// Real fft of `size` samples: the even and odd samples are packed into a size / 2 point
+// complex radix-2 fft over split real/imaginary arrays, and a split step turns its result into
+// the size / 2 + 1 bins of the real input. The twiddles of every stage are stored one after
+// the other, so the butterflies load them as whole vectors.
+typedef struct Fft {
+  u32 size;
+  f32* input;       // `size` windowed samples, written by the caller
+  f32* re;          // size / 2 + 1 bins after fft_forward()
+  f32* im;
+  f32* window;
+  f32* twiddle_re;  // stage with `half` butterflies at [half - 1, 2 * half - 1)
+  f32* twiddle_im;
+  f32* split_re;    // size / 4 + 1 twiddles of the split step
+  f32* split_im;
+  u32* bit_reverse; // size / 2 entries
+} Fft;
+
+// Where the audio thread is in the first source's read-ahead ring, published with a
+// sequence lock: `tail` is the ring position that holds the byte at file offset `cursor`
+typedef struct Play_position {
+  atomic_uint sequence;
+  _Atomic i64 cursor;
+  atomic_uint tail;
+  atomic_uchar valid; // 0 while waiting for the reader to answer a seek
+  atomic_uchar playing;
+  atomic_uchar loop;
+  _Atomic f32 volume;
+} Play_position;
+
+typedef struct Control_client {
+  i32 fd;  // -1 when the slot is free
+  u8 subscribed;
+  u32 line_size;
+  char line[MAX_COMMAND_LINE_SIZE];
+} Control_client;
+
+// Accepts line commands on a unix socket from an epoll loop of its own. Commands are passed
+// on to the ui thread through a second command queue, so that the ui stays the only thread
+// that feeds the audio thread.
+typedef struct Control_server {
+  i32 listen_fd;
+  i32 epoll_fd;
+  i32 wake_fd;   // written on exit
+  i32 timer_fd;  // status pushes to subscribed clients
+  pthread_t thread;
+  u8 running;
+  u8 bound;      // the socket file at g_control_path is ours to remove
+  Control_client clients[MAX_CONTROL_CLIENTS];
+  u64 last_frames;
+  f64 last_time;
+} Control_server;
+
+// Peak and rms per channel. The audio thread owns the running averages and publishes the
+// levels under a sequence lock, the ui thread adds peak hold and the clip indicators.
+typedef struct Level_meters {
+  atomic_uint sequence;
+  _Atomic f32 peak[METER_CHANNELS];
+  _Atomic f32 rms[METER_CHANNELS];
+  atomic_uint clips[METER_CHANNELS]; // samples at or beyond full scale so far
+
+  // audio thread
+  f32 peak_level[METER_CHANNELS];
+  f32 mean_square[METER_CHANNELS];
+
+  // ui thread
+  f32 hold[METER_CHANNELS];
+  u64 hold_ns[METER_CHANNELS];
+  u32 seen_clips[METER_CHANNELS];
+  u64 clip_ns[METER_CHANNELS];
+  u8 rendered;
+  char text[METER_TEXT_SIZE];
+} Level_meters;
+
+// Bytes around the play cursor, copied out of the read-ahead ring instead of read from the
+// file. Rows have a fixed width so a changed row is rewritten in place.
+typedef struct Hex_view {
+  i64 base;        // file offset of the first byte shown
+  i64 cursor;
+  u8 bytes[HEX_ROWS * HEX_BYTES_PER_ROW];
+  u8 present[HEX_ROWS * HEX_BYTES_PER_ROW];
+  u8 rendered;
+  char text[HEX_TEXT_SIZE];
+} Hex_view;
+
+// Statistics per INDEX_BLOCK_SIZE block of the first source. Each block packs entropy
+// (bits per byte * 32), zero ratio and printable ratio (0-255) and a ready bit into one atomic.
+typedef struct Block_index {
+  i64 block_count;
+  _Atomic u32* blocks;
+  atomic_llong next_block;  // next batch to hand out to a worker
+  atomic_llong blocks_done;
+  atomic_ullong histogram[256]; // byte histogram of the whole file
+  atomic_llong histogram_blocks; // blocks added to `histogram` so far
+  pthread_t workers[MAX_INDEX_WORKERS];
+  u32 worker_count;
+  u8* buffers[MAX_INDEX_WORKERS]; // INDEX_BLOCK_SIZE bytes per worker
+  atomic_uint next_buffer;
+  u8 cached;  // blocks point into the analysis cache mapping
+  i64 rendered_done;
+  i32 rendered_column;
+  u8 rendered;
+  char text[INDEX_TEXT_SIZE];
+} Block_index;
+
+#define BLOCK_READY (1u << 24)
+#define BLOCK_ENTROPY(V) (((V) & 0xff) / 32.0f)
+#define BLOCK_ZEROS(V) (((V) >> 8) & 0xff)
+#define BLOCK_TEXT(V) (((V) >> 16) & 0xff)
+
+typedef f32 v8f __attribute__((vector_size(32)));
+
+// Format and data bounds as found in a file header, see audio_header_parse()
+typedef struct Audio_header {
+  const char* container;  // NULL for raw data
+  i32 sample_rate;
+  i32 sample_size;
+  i32 channel_count;
+  u8 big_endian;
+  u8 signed_bytes;
+  u8 float_samples;
+  i64 data_start;
+  i64 data_end;
+} Audio_header;
+
+// A file played through the mixer. The reader thread keeps a ring of upcoming bytes filled so
+// that the audio thread never touches the disk. Seeks are requested by the audio thread by
+// bumping `seek_gen`; the reader answers by publishing `fill_gen` together with the ring
+// position (`fill_head`) where data from the new offset starts.
+typedef struct Source {
+  i32 fd;
+  const char* file_name;
+  i64 file_size;
+  i64 start_pos;      // first byte of sample data
+  i32 sample_size;    // 1 (unsigned 8 bit), 2 or 4 (signed) bytes
+  i32 channel_count;  // interleaved channels in the file
+  i32 sample_rate;    // from the header, 0 for raw data
+  const char* container;
+  u8 big_endian;      // AIFF and AU store samples most significant byte first
+  u8 signed_bytes;    // 8 bit samples are signed instead of unsigned
+  u8 float_samples;   // 4 byte samples are IEEE floats
+  i32 route;          // output channel, or -1 to map channels one to one
+  f32 gain;
+
+  u8* ring;
+  atomic_uint head;   // bytes produced by the reader thread
+  atomic_uint tail;   // bytes consumed by the audio thread
+  _Atomic i64 seek_target;
+  atomic_uint seek_gen;
+  atomic_uint fill_gen;
+  atomic_uint fill_head;
+  atomic_uint starved; // callbacks that found the ring short of data
+  _Atomic i64 seek_region_start; // region the reader wraps in, published with every seek
+  _Atomic i64 seek_region_end;
+  atomic_uint region_gen;        // bumped when the region changed without a seek
+
+  // owned by the audio thread
+  i64 cursor;         // file offset of the next byte to play
+  u32 gen;
+  u32 synced_gen;
+  const u8* prefix;   // cached bytes played before the ring after a jump to a cue
+  u32 prefix_size;
+  u32 prefix_used;
+  i64 region_start;   // playback wraps from region_end back to region_start
+  i64 region_end;
+  u8* scratch;        // linear copy of the bytes being decoded
+  f32* samples;       // decoded samples of one chunk
+
+  // owned by the reader thread
+  i64 fill_pos;       // file offset of the next byte to read
+  i64 fill_start;
+  i64 fill_end;
+  u32 reader_gen;
+  u32 reader_region_gen;
+} Source;
+
+// Cues are only ever added: once `count` covers a cue the audio thread may read its data at any time
+typedef struct Cue {
+  i64 offsets[MAX_SOURCES];  // where the cue is in every source
+  u8* data[MAX_SOURCES];     // the first CUE_PREFETCH_MS of every source from there
+  u32 sizes[MAX_SOURCES];
+} Cue;
+
+typedef struct Cue_list {
+  Cue cues[MAX_CUES];
+  atomic_uint count;
+  u32 rendered_count;
+  u8 rendered;
+  char text[CUE_TEXT_SIZE];
+} Cue_list;
+
+// What a sidecar is valid for, compared byte for byte (zero padded) on load
+typedef struct Analysis_key {
+  u64 device;
+  u64 inode;
+  i64 size;
+  i64 mtime_ns;
+  i64 data_start;
+  i64 data_end;
+  i32 sample_size;
+  i32 channel_count;
+  u8 big_endian;
+  u8 signed_bytes;
+  u8 float_samples;
+  u8 reserved[5];
+} Analysis_key;
+
+// Layout of a sidecar: this header, the waveform pyramid (u32 per bin) and one u32 per
+// index block, all in native byte order so the file is used as mapped
+typedef struct Analysis_cache_header {
+  char magic[4];
+  u32 version;
+  Analysis_key key;
+  u32 waveform_bins;
+  u32 index_block_size;
+  i64 block_count;
+  u64 histogram[256];
+} Analysis_cache_header;
+
+typedef struct Analysis_cache {
+  Analysis_key key;
+  u8 enabled;
+  u8 loaded;
+  void* map;
+  u64 map_size;
+  char path[MAX_FILE_SIZE];
+} Analysis_cache;
+
+// A task of a batch render: chunks [first, end) of the file in slot `slot`, packed into one
+// word so the deques of the workers stay lock-free
+#define BATCH_TASK(SLOT, FIRST, END) ((u64)(SLOT) << 56 | (u64)(FIRST) << 28 | (u64)(END))
+#define BATCH_TASK_SLOT(T) ((u32)((T) >> 56))
+#define BATCH_TASK_FIRST(T) ((u32)((T) >> 28) & 0xfffffff)
+#define BATCH_TASK_END(T) ((u32)(T) & 0xfffffff)
+#define BATCH_MAX_CHUNKS 0xfffffff
+
+// A file being rendered. Slots are taken by the worker that opens the file and given back
+// by whichever worker renders its last chunk.
+typedef struct Batch_file {
+  atomic_int used;
+  const char* path;
+  char output[MAX_FILE_SIZE];
+  Source source;   // format and input fd
+  i32 out_fd;
+  i32 sample_rate;
+  i64 frame_count;
+  i64 chunk_frames;
+  u32 chunk_count;
+  atomic_uint chunks_done;
+  atomic_int failed;  // a write failed, the remaining blocks are skipped
+  f64 start_time;
+  u32 index;       // into the paths of the batch
+} Batch_file;
+
+// What the chunks of one file add up to, one per worker and slot so that workers never share them
+typedef struct Feature_sums {
+  u64 histogram[256];
+  f64 band_power[FEATURE_BANDS];
+  f64 power;
+  f64 weighted_power; // power times bin, for the centroid
+  f64 flatness;       // summed over ffts
+  f64 square_sum;
+  u64 ffts;
+  u64 samples;
+} Feature_sums;
+
+// The index is this header, `count` records and then the paths of the records
+typedef struct Feature_index_header {
+  char magic[4];
+  u32 version;
+  u32 dims;
+  u32 count;
+  i32 sample_size;   // the overrides of the scan, 0 for the file's own format
+  i32 channel_count;
+  u64 names_size;
+} Feature_index_header;
+
+typedef struct Feature_record {
+  f32 features[FEATURE_DIMS];
+  u32 name_offset;
+  u32 name_length;
+} Feature_record;
+
+typedef struct Neighbour {
+  f64 distance;
+  u32 index;
+} Neighbour;
+
+// Chase-Lev deque: the owner pushes and takes at the bottom, thieves steal from the top
+typedef struct Batch_deque {
+  alignas(CACHE_LINE_SIZE) atomic_llong top;
+  alignas(CACHE_LINE_SIZE) atomic_llong bottom;
+  _Atomic u64 tasks[BATCH_DEQUE_SIZE];
+} Batch_deque;
+
+typedef struct Batch_worker {
+  Batch_deque deque;
+  pthread_t thread;
+  u32 index;
+  u32 seed;       // picks the first victim to steal from
+  u8* input;      // BATCH_BLOCK_SIZE bytes each, so memory doesn't grow with the files
+  f32* samples;
+  f32* bus;
+  i16* output;
+  u64 steals;
+  Fft fft;
+  void* fft_memory;
+  u32 fft_fill;        // samples in the fft so far, carried over the blocks of a chunk
+  Feature_sums* sums;  // BATCH_MAX_OPEN_FILES, one per slot
+} Batch_worker;
+
+typedef struct Batch {
+  char** paths;
+  u32 path_count;
+  u32 path_capacity;
+  atomic_uint next_path;
+  atomic_uint active_files;
+  atomic_uint files_done;
+  atomic_uint files_failed;
+  atomic_ullong bytes_in;
+  atomic_ullong bytes_out;
+  Batch_file files[BATCH_MAX_OPEN_FILES];
+  Batch_worker workers[BATCH_MAX_WORKERS];
+  u32 worker_count;
+  u8 scan;             // compute feature vectors instead of rendering
+  u8 quiet;            // no per-file and aggregate reports
+  u8 feature_band[FEATURE_FFT_SIZE / 2];
+  f32* features;       // FEATURE_DIMS per path
+  u8* feature_done;
+} Batch;
+
+typedef enum Slot_state {
+  SlotEmpty = 0,
+  SlotLoading,  // owned by the prefetcher while it reads
+  SlotReady,
+  SlotPinned,   // played from by the audio thread, left alone by the prefetcher
+} Slot_state;
+
+// Data fields are written by the prefetcher in SlotLoading only, the audio thread reads them
+// after taking the slot from SlotReady to SlotPinned
+typedef struct Prefetch_slot {
+  atomic_int state;
+  i64 offsets[MAX_SOURCES];  // where the window starts in every source, offsets[0] is the key
+  u8* data[MAX_SOURCES];
+  u32 sizes[MAX_SOURCES];
+} Prefetch_slot;
+
+typedef struct Prefetcher {
+  Prefetch_slot slots[PREFETCH_SLOTS];
+  _Atomic i64 steps[SEEK_HISTORY];  // recent seek distances, written by the ui thread
+  atomic_uint step_count;
+  atomic_uint hits;
+  atomic_uint misses;
+  pthread_t worker;
+  u8 worker_running;
+  i32 pinned;  // owned by the audio thread, slot the sources play from or -1
+} Prefetcher;
 
 typedef struct Binplay {
-  FILE* fp;
+  Audio_state audio;
+  Command_queue commands;
   const char* file_name;
-  u32 file_size;
-  i32 file_cursor;
-  i32 file_cursor_start_pos;
-  u8 done;
-  u8 play;
+  i64 file_size;
+  i64 file_cursor_start_pos;
+  atomic_uchar done;
   u8 show_help;
   u32 output_size;
   u8* output;
   char info[INFO_BUFFER_SIZE];
+  Info_line info_lines[MaxInfoField];
   f64 time_elapsed;
+  pthread_t writer;
+  u8 writer_running;
+  i16* write_buffer;
+  _Atomic f32 engine_load; // written by whichever thread drives the output, read by the ui and control
+  Xrun_stats xruns;
+  Profile profile;
+  Source sources[MAX_SOURCES]; // the first source is the file given on the command line
+  u32 source_count;
+  pthread_t reader;
+  u8 reader_running;
+  u8 memory_locked;
+  u8 audio_thread_ready; // owned by the audio thread
+  atomic_int rt_audio;
+  atomic_int rt_reader;
+  Waveform waveform;
+  Spectrogram spectrogram;
+  Play_position position;
+  Hex_view hex;
+  Block_index index;
+  Level_meters meters;
+  Cue_list cues;
+  Prefetcher prefetch;
+  Analysis_cache cache;
+  Arena arena;
+  i64 marker_a;  // ui side A and B markers, -1 when not set
+  i64 marker_b;
+  Command_queue remote;  // commands from the control socket, applied by the ui thread
+  Control_server control;
+  f64 start_time;
+  i32 event_fd;          // wakes up the ui loop when the audio side has news
+  atomic_uint ui_dirty;  // set by the audio thread, forwarded to event_fd by the reader thread
+  atomic_uint wake_gen;  // futex word, bumped whenever the reader or the prefetcher may have work
+  atomic_uint sleepers;  // threads (about to be) waiting on `wake_gen`
 } Binplay;
 
+// Result of a Pa_IsFormatSupported() probe, keyed by "<host api>/<device name>"
+typedef struct Device_cache_entry {
+  char name[MAX_DEVICE_NAME_SIZE];
+  i32 sample_rate;
+  u32 sample_format;
+  i32 channel_count;
+  u8 supported;
+} Device_cache_entry;
+
+typedef struct Device_cache {
+  Device_cache_entry entries[MAX_DEVICE_CACHE_ENTRIES];
+  u32 count;
+  u8 dirty;
+} Device_cache;
+
 Binplay binplay = {0};
+Batch g_batch = {0};
+Device_cache device_cache = {0};
+
+#ifdef DEBUG
+// Real-time self-check: the allocator and the common blocking calls are wrapped, and
+// complain whenever they are entered from inside the audio path
+static _Thread_local u8 rt_in_audio_path = 0;
+atomic_uint rt_violations;
+_Atomic(const char*) rt_violation_name;
+
+static void rt_violation(const char* name) {
+  if (rt_in_audio_path) {
+    atomic_fetch_add_explicit(&rt_violations, 1, memory_order_relaxed);
+    atomic_store_explicit(&rt_violation_name, name, memory_order_relaxed);
+  }
+}
+
+#define RT_AUDIO_PATH_BEGIN() (rt_in_audio_path = 1)
+#define RT_AUDIO_PATH_END() (rt_in_audio_path = 0)
+
+// Steady-state check: from the start of playback until shutdown nothing allocates, on any
+// thread. The first offender is named right away, without allocating, and the run fails.
+static atomic_uchar rt_steady_state;
+atomic_uint rt_steady_allocations;
+
+static void rt_allocation(const char* name) {
+  rt_violation(name);
+  if (atomic_load_explicit(&rt_steady_state, memory_order_relaxed) &&
+      atomic_fetch_add_explicit(&rt_steady_allocations, 1, memory_order_relaxed) == 0) {
+    static const char message[] = PROG ": allocation after playback started: ";
+    ssize_t written = write(STDERR_FILENO, message, sizeof(message) - 1);
+    written += write(STDERR_FILENO, name, strlen(name));
+    written += write(STDERR_FILENO, "\n", 1);
+    (void)written;
+  }
+}
+
+#define RT_STEADY_STATE_BEGIN() atomic_store(&rt_steady_state, 1)
+#define RT_STEADY_STATE_END() atomic_store(&rt_steady_state, 0)
+#define RT_LIBC_SYMBOL(FN, NAME) if (!FN) { *(void**)(&FN) = dlsym(RTLD_NEXT, NAME); }
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* p, size_t size);
+extern void __libc_free(void* p);
+
+void* malloc(size_t size) {
+  rt_allocation("malloc");
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+  rt_allocation("calloc");
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* p, size_t size) {
+  rt_allocation("realloc");
+  return __libc_realloc(p, size);
+}
+
+void free(void* p) {
+  rt_violation("free");
+  __libc_free(p);
+}
+
+ssize_t read(i32 fd, void* buffer, size_t size) {
+  static ssize_t (*libc_read)(i32, void*, size_t) = NULL;
+  RT_LIBC_SYMBOL(libc_read, "read");
+  rt_violation("read");
+  return libc_read(fd, buffer, size);
+}
+
+ssize_t write(i32 fd, const void* buffer, size_t size) {
+  static ssize_t (*libc_write)(i32, const void*, size_t) = NULL;
+  RT_LIBC_SYMBOL(libc_write, "write");
+  rt_violation("write");
+  return libc_write(fd, buffer, size);
+}
+
+ssize_t pread(i32 fd, void* buffer, size_t size, off_t offset) {
+  static ssize_t (*libc_pread)(i32, void*, size_t, off_t) = NULL;
+  RT_LIBC_SYMBOL(libc_pread, "pread");
+  rt_violation("pread");
+  return libc_pread(fd, buffer, size, offset);
+}
+
+i32 nanosleep(const struct timespec* duration, struct timespec* remaining) {
+  static i32 (*libc_nanosleep)(const struct timespec*, struct timespec*) = NULL;
+  RT_LIBC_SYMBOL(libc_nanosleep, "nanosleep");
+  rt_violation("nanosleep");
+  return libc_nanosleep(duration, remaining);
+}
+#else
+#define RT_AUDIO_PATH_BEGIN()
+#define RT_AUDIO_PATH_END()
+#define RT_STEADY_STATE_BEGIN()
+#define RT_STEADY_STATE_END()
+#endif
 PaStream* stream = NULL;
 PaStreamParameters output_port;
 
-inline void spin_wait();
 
 static i32 rebuild_program();
 static void exec_command(const char* fmt, ...);
-static char* file_extension(const char* path);
-static void display_info(Binplay* b);
+static u8 info_line_changed(Info_line* line, const u64* inputs, u32 input_count);
+static void info_line_format(Info_line* line, const char* fmt, ...);
+static u8 display_info(Binplay* b);
+static Result command_parse(const char* line, Command* command);
+static void binplay_command(Binplay* b, const Command* command);
+static const char* binplay_command_error(const Command* command);
+static Result offset_parse(const char* text, i64* offset);
+static Result cue_add(Binplay* b, i64 offset);
+static Result cue_load(Binplay* b, const char* path);
+static void cue_free(Binplay* b);
+static u8 cue_list_render(Binplay* b);
+static Result prefetch_start(Binplay* b);
+static i64 prefetch_window_size(const Source* s);
+static i64 cue_prefetch_size(const Source* s);
+static void prefetch_stop(Binplay* b);
+static u8 prefetch_covers(const Prefetch_slot* p, i64 position, i64 margin, i64 region_end);
+static void* prefetch_thread(void* userdata);
+static void prefetch_record_step(Binplay* b, i64 step);
+static i32 prefetch_acquire(Binplay* b, i64 offset);
+static void prefetch_release(Binplay* b);
+static Result command_queue_push(Command_queue* queue, const Command* command);
+static u8 command_queue_pop(Command_queue* queue, Command* command);
+static void binplay_apply_commands(Binplay* b);
+static i64 binplay_cursor(Binplay* b);
+static u8 binplay_playing(Binplay* b);
+static u32 binplay_format_status(Binplay* b, char* text, u32 size, f64 now, u64* last_frames, f64* last_time);
+static void binplay_write_status(Binplay* b, FILE* fp, f64 now, u64* last_frames, f64* last_time);
+static void binplay_drain_remote(Binplay* b);
+static Result control_start(Binplay* b);
+static void control_stop(Binplay* b);
+static void* control_thread(void* userdata);
+static void control_accept(Binplay* b);
+static void control_read(Binplay* b, Control_client* client);
+static void control_send(Control_server* control, Control_client* client, const char* text, u32 size);
+static void control_close_client(Control_server* control, Control_client* client);
+static void binplay_exec_headless(Binplay* b);
+static void on_stop_signal(i32 signal_number);
 static Result binplay_init(Binplay* b, const char* path);
 static void binplay_exec(Binplay* b);
-static i32 binplay_process_audio(void* output);
+static void binplay_notify_ui(Binplay* b);
+static void binplay_wake_workers(Binplay* b);
+static void binplay_wait_workers(Binplay* b, u32 wake, const struct timespec* timeout);
+static Result audio_header_parse(const char* path, i32 fd, i64 file_size, Audio_header* header);
+static Result wav_parse(const char* path, const u8* data, i64 size, Audio_header* header);
+static Result aiff_parse(const char* path, const u8* data, i64 size, Audio_header* header);
+static Result au_parse(const char* path, const u8* data, i64 size, Audio_header* header);
+static f64 read_extended(const u8* p);
+static Result source_open(Source* s, const char* path, i32 sample_size, i32 channel_count, f32 gain, i32 route);
+static Result source_open_file(Source* s, const char* path, i32 sample_size, i32 channel_count);
+static Result source_alloc(Source* s, Arena* arena);
+static Result source_parse_spec(Source* s, char* spec);
+static void source_close(Source* s);
+static void source_publish_region(Source* s);
+static void source_seek(Source* s, i64 offset);
+static i64 source_offset(const Source* s, i64 data_offset);
+static Result source_set_range(Source* s, i64 offset, i64 length);
+static void source_seek_cached(Source* s, i64 offset, const u8* prefix, u32 prefix_size);
+static u8 source_ready(Source* s);
+static u32 source_fill(Source* s);
+static u8 source_mix(Source* s, f32* bus, u32 frames, u8 loop);
+static void source_decode(const Source* s, u8* data, u32 count, f32* samples);
+static void source_route(const Source* s, const f32* samples, u32 frames, f32* bus, i32 bus_channels);
+static void mix_add(f32* restrict bus, const f32* restrict samples, f32 gain, u32 count);
+static void* binplay_reader_thread(void* userdata);
+static u32 waveform_level_offset(u32 level);
+static u32 waveform_visible_level();
+static void source_swap_bytes(u8* data, u32 count, i32 sample_size);
+static void waveform_min_max(const Source* s, u8* data, u32 size, i16* min, i16* max);
+static void waveform_store(Waveform* w, u32 index, i16 min, i16 max, Bin_state state);
+static void* waveform_thread(void* userdata);
+static u8 waveform_render(Binplay* b);
+static void spectrogram_tap(Spectrogram* sg, const f32* bus, u32 frames, f32 volume);
+static u64 fft_memory_size(u32 size);
+static void fft_init(Fft* fft, u32 size, void* memory);
+static void fft_forward(Fft* fft);
+static void* spectrogram_thread(void* userdata);
+static u8 spectrogram_render(Binplay* b);
+static void play_position_publish(Play_position* position, i64 cursor, u32 tail, u8 valid, const Audio_state* audio);
+static u8 play_position_read(Play_position* position, i64* cursor, u32* tail);
+static u8 hex_view_render(Binplay* b);
+static void level_meters_publish(Level_meters* m, const f32* peak, const f32* sum_squares, const u32* clips, u32 frames);
+static u8 level_meters_read(Level_meters* m, f32* peak, f32* rms);
+static i32 meter_column(f32 level);
+static u8 level_meters_render(Binplay* b);
+static void byte_histogram(const u8* data, u32 size, u32* histogram);
+static u32 block_stats(const u32* histogram, u32 size);
+static void* block_index_worker(void* userdata);
+static Result block_index_start(Binplay* b);
+static void block_index_stop(Binplay* b);
+static u8 block_matches(u32 block, Block_kind kind);
+static void binplay_jump_to_block(Binplay* b, Block_kind kind);
+static u8 block_index_render(Binplay* b);
+static void block_index_summary(Block_index* index, char* text, u32 size);
+static void analysis_cache_dir(char* path, u32 size);
+static u64 fnv1a(const void* data, u64 size, u64 hash);
+static void analysis_cache_init(Binplay* b);
+static u8 analysis_cache_load(Binplay* b);
+static void analysis_cache_save(Binplay* b);
+static void analysis_cache_close(Binplay* b);
+static Result batch_collect(Batch* batch, const char* path);
+static Result batch_collect_dir(Batch* batch, const char* path);
+static Result batch_add_path(Batch* batch, const char* path);
+static Result batch_deque_push(Batch_deque* deque, u64 task);
+static u8 batch_deque_take(Batch_deque* deque, u64* task);
+static u8 batch_deque_steal(Batch_deque* deque, u64* task);
+static u8 batch_open_next(Batch* batch, u64* task);
+static Result batch_file_open(Batch* batch, Batch_file* file, u32 index);
+static Result batch_output_open(Batch_file* file);
+static void batch_run_task(Batch* batch, Batch_worker* worker, u64 task);
+static void batch_file_release(Batch* batch, Batch_file* file);
+static void* batch_worker_thread(void* userdata);
+static Result batch_run();
+static Result batch_process(Batch* batch);
+static void batch_free(Batch* batch);
+static void feature_accumulate(Batch* batch, Batch_worker* worker, Feature_sums* sums, const u8* data, u32 size, const f32* samples, u32 frames, i32 channel_count);
+static void feature_finish(Batch* batch, Batch_file* file, u32 slot);
+static Result feature_index_write(Batch* batch, const char* path);
+static Result feature_query();
+static i32 neighbour_compare(const void* a, const void* b);
+static void wav_header_write(u8* header, i64 data_size, i32 channel_count, i32 sample_rate);
+static u8* put_le(u8* p, u64 value, u32 size);
+static Rt_status rt_promote_thread(i32 priority);
+static void rt_prefault(void* p, size_t size);
+static void rt_prefault_stack();
+static void rt_setup_audio_thread(Binplay* b);
+static void rt_lock_memory(Binplay* b);
+static u64 binplay_arena_size(const Binplay* b);
+static Result arena_init(Arena* arena, u64 size, Huge_pages huge_pages);
+static void* arena_push(Arena* arena, u64 size);
+static u64 arena_aligned(u64 size);
+static void arena_free(Arena* arena);
+static u32 binplay_buffer_frames();
+static i32 binplay_process_audio(void* output, u32 frame_count);
+static f64 cpu_time_now(clockid_t clock);
+static u64 clock_ns(clockid_t clock);
+static u32 profile_bucket(u64 ns);
+static u64 profile_bucket_value(u32 bucket);
+static void profile_record(Profile* profile, u64 ns, u32 frames);
+static u64 profile_percentile(Profile* profile, f64 q);
+static Result profile_write_json(Profile* profile, const char* path);
+static void* binplay_writer_thread(void* userdata);
+static void xrun_record(Xrun_stats* xruns, Xrun_kind kind, i64 file_offset);
+static u32 xrun_format(Xrun_stats* xruns, char* buffer, u32 size, u32 max_events);
 static i32 stereo_callback(const void* in_buffer, void* out_buffer, unsigned long frames_per_buffer, const PaStreamCallbackTimeInfo* time_info, PaStreamCallbackFlags flags, void* user_data);
+static void device_cache_path(char* path, u32 size);
+static void device_cache_load(Device_cache* cache);
+static void device_cache_save(Device_cache* cache);
+static void device_cache_name(PaDeviceIndex device, char* name, u32 size);
+static u8 device_is_format_supported(const PaStreamParameters* params, i32 sample_rate);
+static void device_cache_forget(const PaStreamParameters* params, i32 sample_rate);
+static PaDeviceIndex binplay_find_device(const char* device);
+static Result binplay_list_devices();
 static Result binplay_open_stream(Binplay* b);
 static Result binplay_start_stream(Binplay* b);
 static void binplay_exit(Binplay* b);
@@ -115,16 +1151,52 @@ i32 main(i32 argc, char** argv) {
     return 0;
   }
   char* filename = NULL;
+  char* engine = (char*)engine_desc[g_engine];
   Parse_arg args[] = {
     {0, NULL, "filename", ArgString, 0, &filename},
-    {'f', "frames-per-buffer", "number of frames to handle per buffer", ArgInt, 1, &g_frames_per_buffer},
-    {'s', "sample-size", "size of each sample in the data buffer", ArgInt, 1, &g_sample_size},
-    {'c', "channel-count", "how many audio channels to use", ArgInt, 1, &g_channel_count},
-    {'r', "sample-rate", "number of samples per second", ArgInt, 1, &g_sample_rate},
+    {'f', "frames-per-buffer", "number of frames to handle per buffer (0 lets the host decide)", ArgInt, 1, &g_frames_per_buffer},
+    {'s', "sample-size", "size of each sample in the data buffer (read from wav, aiff and au headers by default)", ArgInt, 1, &g_sample_size},
+    {'c', "channel-count", "how many audio channels to use (read from wav, aiff and au headers by default)", ArgInt, 1, &g_channel_count},
+    {'r', "sample-rate", "number of samples per second (read from wav, aiff and au headers by default)", ArgInt, 1, &g_sample_rate},
     {'v', "volume", "startup volume (values between 0.0 and 1.0 give optimal results)", ArgFloat, 1, &g_volume},
+    {'l', "low-latency", "use the low latency profile of the output device (0 or 1)", ArgInt, 1, &g_low_latency},
+    {'L', "latency", "suggested output latency in milliseconds, overrides the latency profile", ArgFloat, 1, &g_latency_ms},
+    {'e', "engine", "output engine, 'callback' or 'blocking' (writer thread using Pa_WriteStream)", ArgString, 1, &engine},
+    {'p', "profile", "dump the processing time histogram as json to this file on exit", ArgString, 1, &g_profile_path},
+    {'m', "mix", "comma separated files to mix in, each as path[:gain[:channel[:sample-size[:channel-count]]]]", ArgString, 1, &g_mix},
+    {'S', "spectrogram-fps", "frame rate of the spectrogram view", ArgInt, 1, &g_spectrogram_fps},
+    {'H', "fft-hop", "samples between two spectrogram ffts (1 to 1024)", ArgInt, 1, &g_fft_hop},
+    {'R', "realtime", "lock memory and run the audio and reader threads with real-time priority (0 or 1)", ArgInt, 1, &g_realtime},
+    {'d', "device", "output device to use, by index or (part of) its name", ArgString, 1, &g_device},
+    {'D', "list-devices", "list host apis and output devices with their supported formats, then exit (0 or 1)", ArgInt, 1, &g_list_devices},
+    {'n', "headless", "run without the terminal ui, take commands from stdin and print json status lines (0 or 1)", ArgInt, 1, &g_headless},
+    {'o', "status-output", "file the headless status lines are appended to instead of stdout", ArgString, 1, &g_status_path},
+    {'u', "status-rate", "headless status lines per second, also used for control socket subscribers", ArgFloat, 1, &g_status_rate},
+    {'P', "progress-step", "seconds the progress line of the ui advances in, larger steps redraw less often over slow terminals", ArgInt, 1, &g_progress_step},
+    {'O', "offset", "start of the range to play, in bytes into the data or with an 's' suffix in seconds", ArgString, 1, &g_offset},
+    {'N', "length", "size of the range to play, in bytes or with an 's' suffix in seconds", ArgString, 1, &g_length},
+    {'k', "cues", "file with one cue offset per line, in bytes or with an 's' suffix in seconds", ArgString, 1, &g_cue_path},
+    {'C', "control-socket", "path of a unix socket that accepts the headless commands, plus subscribe and unsubscribe", ArgString, 1, &g_control_path},
+    {'B', "batch", "render every file under this directory, or listed in this file one per line, to 16 bit wav and exit", ArgString, 1, &g_batch_path},
+    {'w', "batch-output", "directory the batch renders are written to", ArgString, 1, &g_batch_output},
+    {'j', "jobs", "worker threads of the batch render (0 for one per core)", ArgInt, 1, &g_jobs},
+    {'F', "features", "with --batch, write a feature index of the files instead of rendering them; with --query, search it", ArgString, 1, &g_feature_index},
+    {'Q', "query", "print the files of the feature index that sound most like this one and exit", ArgString, 1, &g_query_path},
+    {'K', "neighbours", "number of files printed by --query", ArgInt, 1, &g_neighbours},
+    {'g', "huge-pages", "back the session buffers with huge pages: 0 off, 1 transparent, 2 explicit (falls back to 1)", ArgInt, 1, &g_huge_pages},
+    {'A', "analysis-cache", "reuse the waveform and entropy analyses of files that didn't change since the last run (0 or 1)", ArgInt, 1, &g_analysis_cache},
   };
   arg_parser_init(0, 4, 4);
   ParseResult result = parse_args(args, ARR_SIZE(args), argc, argv);
+  if (result == ArgParseOk && g_list_devices) {
+    return binplay_list_devices() == NoError ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  if (result == ArgParseOk && g_batch_path) {
+    return batch_run() == NoError ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  if (result == ArgParseOk && g_query_path) {
+    return feature_query() == NoError ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
   // TODO(lucas): Try to read from pipe if no filename was specified,
   // and if that fails we exit with a failure code.
   if (!filename) {
@@ -133,12 +1205,32 @@ i32 main(i32 argc, char** argv) {
     return EXIT_FAILURE;
   }
   if (result == ArgParseOk) {
+    if (strncmp(engine, engine_desc[EngineCallback], MAX_FILE_SIZE) == 0) {
+      g_engine = EngineCallback;
+    }
+    else if (strncmp(engine, engine_desc[EngineBlocking], MAX_FILE_SIZE) == 0) {
+      g_engine = EngineBlocking;
+    }
+    else {
+      fprintf(stderr, "Unknown engine '%s', expected 'callback' or 'blocking'\n", engine);
+      return EXIT_FAILURE;
+    }
     Binplay* b = &binplay;
     if (binplay_init(b, filename) == NoError) {
       if (binplay_open_stream(b) == NoError) {
-        binplay_exec(b);
+        if (g_headless) {
+          binplay_exec_headless(b);
+        }
+        else {
+          binplay_exec(b);
+        }
       }
       binplay_exit(b);
+#ifdef DEBUG
+      if (atomic_load(&rt_steady_allocations)) {
+        return EXIT_FAILURE;
+      }
+#endif
     }
   }
   else if (result == ArgParseError) {
@@ -147,10 +1239,6 @@ i32 main(i32 argc, char** argv) {
   return EXIT_SUCCESS;
 }
 
-void spin_wait() {
-  sleep(0);
-}
-
 // Compare modify dates between executable and source file
 // Recompile and run program again if they differ.
 i32 rebuild_program() {
@@ -189,21 +1277,27 @@ void exec_command(const char* fmt, ...) {
   fclose(fp);
 }
 
-char* file_extension(const char* path) {
-  char* result = (char*)path;
-  for (;;) {
-    char ch = *path++;
-    if (ch == 0) {
-      return result;
-    }
-    if (ch == '.') {
-      return (char*)path - 1;
-    }
+u8 info_line_changed(Info_line* line, const u64* inputs, u32 input_count) {
+  assert(input_count <= MAX_INFO_INPUTS);
+  if (line->valid && memcmp(line->inputs, inputs, input_count * sizeof(u64)) == 0) {
+    return 0;
   }
-  return result;
+  memcpy(line->inputs, inputs, input_count * sizeof(u64));
+  line->valid = 1;
+  return 1;
+}
+
+void info_line_format(Info_line* line, const char* fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  i32 length = vsnprintf(line->text, INFO_LINE_SIZE, fmt, args);
+  va_end(args);
+  line->length = length < 0 ? 0 : (length >= INFO_LINE_SIZE ? INFO_LINE_SIZE - 1 : length);
 }
 
-void display_info(Binplay* b) {
+// Refresh the sections of the status panel whose values changed since the last call.
+// Returns 1 if anything changed and the panel has to be redrawn.
+u8 display_info(Binplay* b) {
   const char* play_status[2] = {
     "",
     "[paused]",
@@ -212,79 +1306,425 @@ void display_info(Binplay* b) {
     "",
     "[looping]",
   };
+  Info_line* lines = &b->info_lines[0];
+  u8 changed = 0;
 
-  char* buffer = &b->info[0];
-
-  int seconds = (b->file_cursor / (f32)g_sample_size) / (g_sample_rate * g_channel_count);
-  int minutes = (int)(seconds / 60.0f);
-  int hours   = (int)(minutes / 60.0f);
-  seconds %= 60;
-  minutes %= 60;
-
-  int seconds_total = (b->file_size / (f32)g_sample_size) / (g_sample_rate * g_channel_count);
-  int minutes_total = (int)(seconds_total / 60.0f);
-  int hours_total   = (int)(minutes_total / 60.0f);
-  seconds_total %= 60;
-  minutes_total %= 60;
-
-  snprintf(
-    buffer,
-    INFO_BUFFER_SIZE,
-    "Currently playing: %s %s\n"
-    "Progress: [%02d:%02d:%02d - %02d:%02d:%02d] (%d%%) %s\n"
-    "\n"
-    "Volume: %d%%\n"
-    "Channel count: %d\n"
-    "Sample rate: %d\n"
-    "Sample size: %d\n"
-    "Frames per buffer: %d\n"
-    ,
-    b->file_name,
-    play_status[b->play == 0],
-    hours, minutes, seconds,
-    hours_total, minutes_total, seconds_total,
-    (u32)(100 * (f32)b->file_cursor / b->file_size),
-    loop_status[g_loop_after_complete != 0],
-    (u32)(100 * g_volume),
-    g_channel_count,
-    g_sample_rate,
-    g_sample_size,
-    g_frames_per_buffer
-  );
+  {
+    const u8 playing = binplay_playing(b);
+    u64 inputs[] = { playing, };
+    if (info_line_changed(&lines[InfoPlaying], inputs, ARR_SIZE(inputs))) {
+      info_line_format(&lines[InfoPlaying], "Currently playing: %s %s\n", b->file_name, play_status[playing == 0]);
+      changed = 1;
+    }
+  }
+  {
+    u64 inputs[] = { b->source_count, };
+    if (info_line_changed(&lines[InfoMix], inputs, ARR_SIZE(inputs))) {
+      Info_line* line = &lines[InfoMix];
+      line->length = 0;
+      line->text[0] = 0;
+      for (u32 i = 1; i < b->source_count && line->length < INFO_LINE_SIZE; ++i) {
+        Source* s = &b->sources[i];
+        char route[16] = "all";
+        if (s->route >= 0) {
+          snprintf(route, sizeof(route), "%d", s->route);
+        }
+        line->length += snprintf(&line->text[line->length], INFO_LINE_SIZE - line->length, "  + %s (gain: %.2f, channel: %s)\n", s->file_name, s->gain, route);
+      }
+      if (line->length >= INFO_LINE_SIZE) {
+        line->length = INFO_LINE_SIZE - 1;
+      }
+      changed = 1;
+    }
+  }
+  {
+    const i64 start = b->sources[0].start_pos;
+    const i64 cursor = binplay_cursor(b) - start;
+    const i64 size = b->file_size - start;
+    i32 seconds = (cursor / (f32)g_sample_size) / (g_sample_rate * g_channel_count);
+    i32 seconds_total = (size / (f32)g_sample_size) / (g_sample_rate * g_channel_count);
+    u32 percent = (u32)(100 * (f32)cursor / size);
+    // The progress line is what changes every second during playback, so its step decides how
+    // often an otherwise quiet panel is redrawn
+    if (g_progress_step > 1) {
+      seconds -= seconds % g_progress_step;
+    }
+    u64 inputs[] = { seconds, seconds_total, percent, g_loop_after_complete != 0, };
+    if (info_line_changed(&lines[InfoProgress], inputs, ARR_SIZE(inputs))) {
+      i32 minutes = (i32)(seconds / 60.0f);
+      i32 hours   = (i32)(minutes / 60.0f);
+      seconds %= 60;
+      minutes %= 60;
+
+      i32 minutes_total = (i32)(seconds_total / 60.0f);
+      i32 hours_total   = (i32)(minutes_total / 60.0f);
+      seconds_total %= 60;
+      minutes_total %= 60;
+
+      info_line_format(&lines[InfoProgress], "Progress: [%02d:%02d:%02d - %02d:%02d:%02d] (%d%%) %s\n\n",
+        hours, minutes, seconds,
+        hours_total, minutes_total, seconds_total,
+        percent,
+        loop_status[g_loop_after_complete != 0]
+      );
+      changed = 1;
+    }
+  }
+  {
+    const Source* primary = &b->sources[0];
+    u64 inputs[] = { b->marker_a, b->marker_b, primary->start_pos, b->file_size, };
+    if (info_line_changed(&lines[InfoRegion], inputs, ARR_SIZE(inputs))) {
+      Info_line* line = &lines[InfoRegion];
+      line->length = 0;
+      line->text[0] = 0;
+      if (g_offset || g_length) {
+        line->length += snprintf(&line->text[line->length], INFO_LINE_SIZE - line->length, "Range: 0x%llx - 0x%llx\n",
+          (unsigned long long)primary->start_pos, (unsigned long long)b->file_size);
+      }
+      if (b->marker_a >= 0 || b->marker_b >= 0) {
+        char a[32] = "-";
+        char marker_b[32] = "-";
+        if (b->marker_a >= 0) {
+          snprintf(a, sizeof(a), "0x%llx", (unsigned long long)b->marker_a);
+        }
+        if (b->marker_b >= 0) {
+          snprintf(marker_b, sizeof(marker_b), "0x%llx", (unsigned long long)b->marker_b);
+        }
+        const u8 active = b->marker_a >= 0 && b->marker_b > b->marker_a;
+        line->length += snprintf(&line->text[line->length], INFO_LINE_SIZE - line->length, "A-B loop: %s - %s %s\n", a, marker_b, active ? "[looping]" : "");
+      }
+      if (line->length >= INFO_LINE_SIZE) {
+        line->length = INFO_LINE_SIZE - 1;
+      }
+      changed = 1;
+    }
+  }
+  {
+    u64 inputs[] = { (u32)(100 * g_volume), };
+    if (info_line_changed(&lines[InfoVolume], inputs, ARR_SIZE(inputs))) {
+      info_line_format(&lines[InfoVolume], "Volume: %d%%\n", (u32)(100 * g_volume));
+      changed = 1;
+    }
+  }
+  {
+    u64 inputs[] = { g_channel_count, g_sample_rate, g_sample_size, g_frames_per_buffer, };
+    if (info_line_changed(&lines[InfoFormat], inputs, ARR_SIZE(inputs))) {
+      char frames_per_buffer[32] = {0};
+      if (g_frames_per_buffer == paFramesPerBufferUnspecified) {
+        snprintf(frames_per_buffer, sizeof(frames_per_buffer), "unspecified");
+      }
+      else {
+        snprintf(frames_per_buffer, sizeof(frames_per_buffer), "%d", g_frames_per_buffer);
+      }
+      const Source* primary = &b->sources[0];
+      info_line_format(&lines[InfoFormat],
+        "File format: %s%s%s\n"
+        "Channel count: %d\n"
+        "Sample rate: %d\n"
+        "Sample size: %d\n"
+        "Frames per buffer: %s\n",
+        primary->container ? primary->container : "raw",
+        primary->float_samples ? ", float" : "",
+        primary->big_endian ? ", big endian" : "",
+        g_channel_count,
+        g_sample_rate,
+        g_sample_size,
+        frames_per_buffer
+      );
+      changed = 1;
+    }
+  }
+  {
+    f64 output_latency = 0.0;
+    const PaStreamInfo* stream_info = stream ? Pa_GetStreamInfo(stream) : NULL;
+    if (stream_info) {
+      output_latency = stream_info->outputLatency;
+    }
+    u64 inputs[] = { stream != NULL, output_port.device, (u64)(10000 * output_latency), };
+    if (info_line_changed(&lines[InfoOutput], inputs, ARR_SIZE(inputs))) {
+      const PaDeviceInfo* device_info = stream ? Pa_GetDeviceInfo(output_port.device) : NULL;
+      info_line_format(&lines[InfoOutput],
+        "Output device: %s\n"
+        "Output latency: %.1f ms (%s)\n",
+        device_info ? device_info->name : "-",
+        1000 * output_latency,
+        g_latency_ms > 0.0f ? "requested" : (g_low_latency ? "low" : "high")
+      );
+      changed = 1;
+    }
+  }
+  {
+    if (stream && g_engine == EngineCallback) {
+      atomic_store_explicit(&b->engine_load, Pa_GetStreamCpuLoad(stream), memory_order_relaxed);
+    }
+    const f32 engine_load = atomic_load_explicit(&b->engine_load, memory_order_relaxed);
+    u64 inputs[] = { (u64)(1000 * engine_load), };
+    if (info_line_changed(&lines[InfoEngine], inputs, ARR_SIZE(inputs))) {
+      info_line_format(&lines[InfoEngine], "Engine: %s (cpu load: %.1f%%)\n", engine_desc[g_engine], 100 * engine_load);
+      changed = 1;
+    }
+  }
+  {
+    u64 inputs[] = { atomic_load_explicit(&b->xruns.event_count, memory_order_acquire), };
+    if (info_line_changed(&lines[InfoXruns], inputs, ARR_SIZE(inputs))) {
+      char xruns[128] = {0};
+      xrun_format(&b->xruns, xruns, sizeof(xruns), 3);
+      info_line_format(&lines[InfoXruns], "Xruns: %s\n", xruns);
+      changed = 1;
+    }
+  }
+  {
+    u32 starved = 0;
+    for (u32 i = 0; i < b->source_count; ++i) {
+      starved += atomic_load_explicit(&b->sources[i].starved, memory_order_relaxed);
+    }
+    u64 inputs[] = { starved, b->source_count, };
+    if (info_line_changed(&lines[InfoReadAhead], inputs, ARR_SIZE(inputs))) {
+      info_line_format(&lines[InfoReadAhead], "Read-ahead misses: %u (%u sources)\n", starved, b->source_count);
+      changed = 1;
+    }
+  }
+  {
+    u64 inputs[] = { g_realtime, b->memory_locked, atomic_load(&b->rt_audio), atomic_load(&b->rt_reader), b->arena.used, 0, 0, };
+#ifdef DEBUG
+    inputs[5] = atomic_load(&rt_violations);
+    inputs[6] = atomic_load(&rt_steady_allocations);
+#endif
+    if (info_line_changed(&lines[InfoRealtime], inputs, ARR_SIZE(inputs))) {
+      char realtime[128] = "off";
+      if (g_realtime) {
+        snprintf(realtime, sizeof(realtime), "memory %s, audio thread %s, reader thread %s",
+          b->memory_locked ? "locked" : "not locked",
+          rt_status_desc[atomic_load(&b->rt_audio)],
+          rt_status_desc[atomic_load(&b->rt_reader)]
+        );
+      }
+#ifdef DEBUG
+      if (inputs[5]) {
+        u32 length = strlen(realtime);
+        snprintf(&realtime[length], sizeof(realtime) - length, " (%u violations, last: %s)", (u32)inputs[5], atomic_load(&rt_violation_name));
+      }
+      if (inputs[6]) {
+        u32 length = strlen(realtime);
+        snprintf(&realtime[length], sizeof(realtime) - length, " (%u allocations while playing)", (u32)inputs[6]);
+      }
+#endif
+      info_line_format(&lines[InfoRealtime], "Realtime: %s, buffers: %.1f MB (huge pages %s)\n", realtime, b->arena.used / (1024.0 * 1024.0), huge_pages_desc[b->arena.huge_pages]);
+      changed = 1;
+    }
+  }
+  {
+    // Keyed on the displayed precision (0.1 us) so that jitter below it doesn't cause redraws
+    u64 inputs[] = {
+      profile_percentile(&b->profile, 0.5) / 100,
+      profile_percentile(&b->profile, 0.99) / 100,
+      profile_percentile(&b->profile, 0.999) / 100,
+      atomic_load_explicit(&b->profile.max_ns, memory_order_relaxed) / 100,
+    };
+    if (info_line_changed(&lines[InfoProcessTime], inputs, ARR_SIZE(inputs))) {
+      // Deadline of one callback, i.e. the duration of the audio it produces
+      f64 budget_us = 1e6 * binplay_buffer_frames() / g_sample_rate;
+      info_line_format(&lines[InfoProcessTime], "Process time: p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us (budget %.0f us)\n",
+        inputs[0] / 10.0,
+        inputs[1] / 10.0,
+        inputs[2] / 10.0,
+        inputs[3] / 10.0,
+        budget_us
+      );
+      changed = 1;
+    }
+  }
+  {
+    u64 inputs[] = {
+      atomic_load_explicit(&b->prefetch.hits, memory_order_relaxed),
+      atomic_load_explicit(&b->prefetch.misses, memory_order_relaxed),
+    };
+    if (info_line_changed(&lines[InfoPrefetch], inputs, ARR_SIZE(inputs))) {
+      const u64 seeks = inputs[0] + inputs[1];
+      info_line_format(&lines[InfoPrefetch], "Prefetch: %llu hits, %llu misses (%.0f%% hit rate)\n",
+        (unsigned long long)inputs[0],
+        (unsigned long long)inputs[1],
+        seeks ? 100.0 * inputs[0] / seeks : 0.0
+      );
+      changed = 1;
+    }
+  }
+
+  if (changed) {
+    u32 length = 0;
+    for (u32 i = 0; i < MaxInfoField; ++i) {
+      u32 size = lines[i].length;
+      if (length + size >= INFO_BUFFER_SIZE) {
+        size = INFO_BUFFER_SIZE - 1 - length;
+      }
+      memcpy(&b->info[length], lines[i].text, size);
+      length += size;
+    }
+    b->info[length] = 0;
+  }
+  return changed;
 }
 
 Result binplay_init(Binplay* b, const char* path) {
   Result result = NoError;
-  if (!(b->fp = fopen(path, "r"))) {
-    fprintf(stderr, "Failed to open '%s'\n", path);
+  b->source_count = 0;
+  b->reader_running = 0;
+  if (source_open(&b->sources[0], path, g_sample_size, g_channel_count, 1.0f, -1) != NoError) {
     return_defer(Error);
   }
-  char* ext = file_extension(path);
+  b->source_count = 1;
+  // Whatever wasn't given on the command line comes from the header of the file
+  g_sample_size = b->sources[0].sample_size;
+  g_channel_count = b->sources[0].channel_count;
+  if (!g_sample_rate) {
+    g_sample_rate = b->sources[0].sample_rate ? b->sources[0].sample_rate : SAMPLE_RATE;
+  }
+  g_cursor_speed = 10 * g_sample_rate * g_sample_size * g_channel_count;
+  if (g_mix) {
+    char* spec = strtok(g_mix, ",");
+    for (; spec; spec = strtok(NULL, ",")) {
+      if (b->source_count >= MAX_SOURCES) {
+        fprintf(stderr, "Too many sources to mix (max %d)\n", MAX_SOURCES);
+        return_defer(Error);
+      }
+      if (source_parse_spec(&b->sources[b->source_count], spec) != NoError) {
+        return_defer(Error);
+      }
+      const Source* s = &b->sources[b->source_count];
+      if (s->sample_rate && s->sample_rate != g_sample_rate) {
+        fprintf(stderr, "'%s' is %d Hz but plays at %d Hz\n", s->file_name, s->sample_rate, g_sample_rate);
+      }
+      b->source_count += 1;
+    }
+  }
 
-  b->file_name = path;
-  fseek(b->fp, 0, SEEK_END);
-  b->file_size = ftell(b->fp);
-  fseek(b->fp, 0, SEEK_SET);
-  b->file_cursor = 0;
-  b->file_cursor_start_pos = 0;
-#ifdef SKIP_44
-  if (b->file_size > 44 && strncmp(ext, ".wav", MAX_FILE_SIZE) == 0) {
-    b->file_cursor = 44;
-    b->file_cursor_start_pos = b->file_cursor;
+  if (g_offset || g_length) {
+    i64 offset = 0;
+    i64 length = 0;
+    if ((g_offset && offset_parse(g_offset, &offset) != NoError) || (g_length && offset_parse(g_length, &length) != NoError)) {
+      fprintf(stderr, "Invalid range, expected a number of bytes or seconds with an 's' suffix\n");
+      return_defer(Error);
+    }
+    for (u32 i = 0; i < b->source_count; ++i) {
+      if (source_set_range(&b->sources[i], offset, length) != NoError) {
+        return_defer(Error);
+      }
+    }
   }
-#endif
-  b->done = 0;
-  b->play = 1;
+  // Every buffer of the session comes from here, sized now that all sources are known
+  if (arena_init(&b->arena, binplay_arena_size(b), g_huge_pages) != NoError) {
+    return_defer(Error);
+  }
+  for (u32 i = 0; i < b->source_count; ++i) {
+    if (source_alloc(&b->sources[i], &b->arena) != NoError) {
+      return_defer(Error);
+    }
+  }
+  b->marker_a = -1;
+  b->marker_b = -1;
+  memset(&b->cues, 0, sizeof(b->cues));
+  if (g_cue_path && cue_load(b, g_cue_path) != NoError) {
+    return_defer(Error);
+  }
+
+  b->file_name = path;
+  b->file_size = b->sources[0].file_size;
+  b->file_cursor_start_pos = b->sources[0].start_pos;
+  atomic_store(&b->done, 0);
+  b->audio.play = 1;
+  b->audio.loop = g_loop_after_complete != 0;
+  b->audio.volume = g_volume;
+  atomic_store(&b->commands.head, 0);
+  atomic_store(&b->commands.tail, 0);
+  atomic_store(&b->commands.dropped, 0);
   b->show_help = 0;
-  b->output_size = g_frames_per_buffer * g_sample_size * g_channel_count;
-  b->output = malloc(b->output_size);
+  // mix bus
+  b->output_size = binplay_buffer_frames() * g_channel_count * sizeof(f32);
+  b->output = arena_push(&b->arena, b->output_size);
   memset(b->info, 0, sizeof(b->info));
+  memset(b->info_lines, 0, sizeof(b->info_lines));
   b->time_elapsed = 0.0f;
+  b->writer_running = 0;
+  b->write_buffer = NULL;
+  atomic_store_explicit(&b->engine_load, 0.0f, memory_order_relaxed);
+  memset(&b->xruns, 0, sizeof(b->xruns));
+  memset(&b->profile, 0, sizeof(b->profile));
 
   if (!b->output) {
     b->output_size = 0;
     return_defer(Error);
   }
+  if (g_engine == EngineBlocking) {
+    if (!(b->write_buffer = arena_push(&b->arena, WRITE_BLOCK_FRAMES * g_channel_count * sizeof(i16)))) {
+      return_defer(Error);
+    }
+  }
+  atomic_store(&b->ui_dirty, 0);
+  atomic_store(&b->wake_gen, 0);
+  atomic_store(&b->sleepers, 0);
+  if ((b->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    fprintf(stderr, "Failed to create eventfd\n");
+    return_defer(Error);
+  }
+  b->memory_locked = 0;
+  b->audio_thread_ready = 0;
+  atomic_store(&b->rt_audio, RtOff);
+  atomic_store(&b->rt_reader, RtOff);
+  if (g_realtime) {
+    rt_lock_memory(b);
+  }
+  if (pthread_create(&b->reader, NULL, binplay_reader_thread, b) != 0) {
+    fprintf(stderr, "Failed to start reader thread\n");
+    return_defer(Error);
+  }
+  b->reader_running = 1;
+  memset(&b->prefetch, 0, sizeof(b->prefetch));
+  b->prefetch.pinned = -1;
+  if (prefetch_start(b) != NoError) {
+    fprintf(stderr, "Failed to start prefetcher, seeks wait on the disk\n");
+  }
+  memset(&b->waveform, 0, sizeof(b->waveform));
+  memset(&b->index, 0, sizeof(b->index));
+  b->waveform.buffer = arena_push(&b->arena, WAVEFORM_SCAN_CHUNK);
+  analysis_cache_init(b);
+  const u8 cached = !g_headless && analysis_cache_load(b);
+  if (!g_headless && !cached && pthread_create(&b->waveform.worker, NULL, waveform_thread, b) == 0) {
+    b->waveform.worker_running = 1;
+  }
+  memset(&b->position, 0, sizeof(b->position));
+  atomic_store(&b->position.cursor, b->sources[0].start_pos);
+  atomic_store(&b->position.playing, 1);
+  atomic_store(&b->position.loop, b->audio.loop);
+  atomic_store(&b->position.volume, b->audio.volume);
+  b->start_time = cpu_time_now(CLOCK_MONOTONIC);
+  atomic_store(&b->remote.head, 0);
+  atomic_store(&b->remote.tail, 0);
+  atomic_store(&b->remote.dropped, 0);
+  memset(&b->control, 0, sizeof(b->control));
+  b->control.listen_fd = b->control.epoll_fd = b->control.wake_fd = b->control.timer_fd = -1;
+  for (u32 i = 0; i < MAX_CONTROL_CLIENTS; ++i) {
+    b->control.clients[i].fd = -1;
+  }
+  if (g_control_path && control_start(b) != NoError) {
+    return_defer(Error);
+  }
+  memset(&b->hex, 0, sizeof(b->hex));
+  memset(&b->meters, 0, sizeof(b->meters));
+  memset(&b->spectrogram, 0, sizeof(b->spectrogram));
+  if (g_headless) {
+    // Nothing is drawn, so none of the analysis workers are started
+    return_defer(NoError);
+  }
+  if (!cached) {
+    block_index_start(b);
+  }
+  g_fft_hop = CLAMP(g_fft_hop, 1, SPECTRUM_FFT_SIZE);
+  g_spectrogram_fps = CLAMP(g_spectrogram_fps, 1, 120);
+  b->spectrogram.window = arena_push(&b->arena, SPECTRUM_FFT_SIZE * sizeof(f32));
+  b->spectrogram.fft_memory = arena_push(&b->arena, fft_memory_size(SPECTRUM_FFT_SIZE));
+  if (pthread_create(&b->spectrogram.worker, NULL, spectrogram_thread, b) == 0) {
+    b->spectrogram.worker_running = 1;
+  }
   if (!Ok(tg_init())) {
     fprintf(stderr, "Failed to initialize termgui: %s\n", tg_err_string());
     return_defer(Error);
@@ -310,6 +1750,66 @@ void binplay_exec(Binplay* b) {
   container->input_callback = on_input_event;
   container->userdata = b;
 
+  Element waveform_container_element;
+  tg_container_init(&waveform_container_element, true);
+
+  Element* waveform_container = tg_attach_element(container, &waveform_container_element);
+  waveform_container->padding = 1;
+  waveform_container->focusable = false;
+
+  waveform_render(b);
+  Element waveform_text_element;
+  tg_text_init(&waveform_text_element, &b->waveform.text[0]);
+
+  Element* waveform_text = tg_attach_element(waveform_container, &waveform_text_element);
+  waveform_text->border = false;
+  waveform_text->focusable = false;
+
+  Element spectrogram_container_element;
+  tg_container_init(&spectrogram_container_element, true);
+
+  Element* spectrogram_container = tg_attach_element(container, &spectrogram_container_element);
+  spectrogram_container->padding = 1;
+  spectrogram_container->focusable = false;
+
+  spectrogram_render(b);
+  Element spectrogram_text_element;
+  tg_text_init(&spectrogram_text_element, &b->spectrogram.text[0]);
+
+  Element* spectrogram_text = tg_attach_element(spectrogram_container, &spectrogram_text_element);
+  spectrogram_text->border = false;
+  spectrogram_text->focusable = false;
+
+  Element meters_container_element;
+  tg_container_init(&meters_container_element, true);
+
+  Element* meters_container = tg_attach_element(container, &meters_container_element);
+  meters_container->padding = 1;
+  meters_container->focusable = false;
+
+  level_meters_render(b);
+  Element meters_text_element;
+  tg_text_init(&meters_text_element, &b->meters.text[0]);
+
+  Element* meters_text = tg_attach_element(meters_container, &meters_text_element);
+  meters_text->border = false;
+  meters_text->focusable = false;
+
+  Element index_container_element;
+  tg_container_init(&index_container_element, true);
+
+  Element* index_container = tg_attach_element(container, &index_container_element);
+  index_container->padding = 1;
+  index_container->focusable = false;
+
+  block_index_render(b);
+  Element index_text_element;
+  tg_text_init(&index_text_element, &b->index.text[0]);
+
+  Element* index_text = tg_attach_element(index_container, &index_text_element);
+  index_text->border = false;
+  index_text->focusable = false;
+
   Element info_text_container_element;
   tg_container_init(&info_text_container_element, true);
 
@@ -324,117 +1824,4503 @@ void binplay_exec(Binplay* b) {
   info_text->border = false;
   info_text->focusable = false;
 
+  cue_list_render(b);
+  Element cue_text_element;
+  tg_text_init(&cue_text_element, &b->cues.text[0]);
+
+  Element* cue_text = tg_attach_element(info_text_container, &cue_text_element);
+  cue_text->border = false;
+  cue_text->focusable = false;
+
+  Element hex_container_element;
+  tg_container_init(&hex_container_element, true);
+
+  Element* hex_container = tg_attach_element(container, &hex_container_element);
+  hex_container->padding = 1;
+  hex_container->focusable = false;
+
+  hex_view_render(b);
+  Element hex_text_element;
+  tg_text_init(&hex_text_element, &b->hex.text[0]);
+
+  Element* hex_text = tg_attach_element(hex_container, &hex_text_element);
+  hex_text->border = false;
+  hex_text->focusable = false;
+
+  i32 timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  struct itimerspec interval = {0};
+  interval.it_interval.tv_sec = UI_REFRESH_INTERVAL_MS / 1000;
+  interval.it_interval.tv_nsec = (UI_REFRESH_INTERVAL_MS % 1000) * 1000000L;
+  interval.it_value = interval.it_interval;
+  if (timer_fd >= 0) {
+    timerfd_settime(timer_fd, 0, &interval, NULL);
+  }
+
+  // Sleep until there is input, the refresh timer fires or the audio side has something to show
+  struct pollfd fds[] = {
+    { .fd = STDIN_FILENO, .events = POLLIN, },
+    { .fd = timer_fd, .events = POLLIN, },
+    { .fd = b->event_fd, .events = POLLIN, },
+  };
+
   display_info(b);
-  while (!b->done) {
-    TIMER_START();
+  while (!atomic_load(&b->done)) {
     if (!Ok(tg_update())) {
       break;
     }
     tg_render();
-    spin_wait();
-    TIMER_END(
-      b->time_elapsed += _dt;
-    );
+    if (poll(fds, ARR_SIZE(fds), -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (fds[0].revents & (POLLHUP | POLLERR)) {
+      fds[0].fd = -1; // input went away, keep running on the timer alone
+    }
+    u64 count = 0;
+    if ((fds[1].revents & POLLIN) && read(timer_fd, &count, sizeof(count)) == sizeof(count)) {
+      b->time_elapsed += count * (UI_REFRESH_INTERVAL_MS / 1000.0);
+    }
+    if ((fds[2].revents & POLLIN) && read(b->event_fd, &count, sizeof(count)) == sizeof(count)) {
+      binplay_drain_remote(b);
+      // Refresh on the next update instead of waiting for the timer
+      b->time_elapsed += 1.0;
+    }
+  }
+  if (timer_fd >= 0) {
+    close(timer_fd);
   }
 }
 
-i32 stereo_callback(const void* in_buffer, void* out_buffer, unsigned long frames_per_buffer, const PaStreamCallbackTimeInfo* time_info, PaStreamCallbackFlags flags, void* user_data) {
-  if (binplay_process_audio(out_buffer) == NoError) {
-    return paContinue;
+// Parses one line of the text protocol:
+//   play | pause | toggle | loop [on|off] | seek [+|-]<bytes>[s] | volume [+|-]<amount>
+//   next high|low|text | cue set | cue <1-10> | region <start> <end> | region off | status | quit
+// A seek with an 's' suffix counts seconds instead of bytes.
+Result command_parse(const char* line, Command* command) {
+  char name[32] = {0};
+  char arg[64] = {0};
+  char arg2[64] = {0};
+  memset(command, 0, sizeof(*command));
+  i32 count = sscanf(line, " %31s %63s %63s", name, arg, arg2);
+  if (count < 1) {
+    return Error;
+  }
+  const u8 relative = arg[0] == '+' || arg[0] == '-';
+  if (strcmp(name, "play") == 0) {
+    command->type = CommandPlay;
+  }
+  else if (strcmp(name, "pause") == 0) {
+    command->type = CommandPause;
+  }
+  else if (strcmp(name, "toggle") == 0) {
+    command->type = CommandTogglePause;
+  }
+  else if (strcmp(name, "loop") == 0) {
+    command->type = CommandLoop;
+    command->amount = count < 2 ? -1 : (strcmp(arg, "on") == 0 ? 1 : (strcmp(arg, "off") == 0 ? 0 : -2));
+    if (command->amount < -1) {
+      return Error;
+    }
+  }
+  else if (strcmp(name, "seek") == 0 && count == 2) {
+    if (offset_parse(arg, &command->offset) != NoError) {
+      return Error;
+    }
+    command->type = relative ? CommandSeekBy : CommandSeek;
+  }
+  else if (strcmp(name, "region") == 0 && count >= 2) {
+    command->type = CommandRegion;
+    command->offset = -1;
+    command->end = -1;
+    if (strcmp(arg, "off") != 0 && (count != 3 || offset_parse(arg, &command->offset) != NoError || offset_parse(arg2, &command->end) != NoError)) {
+      return Error;
+    }
+  }
+  else if (strcmp(name, "cue") == 0 && count == 2) {
+    if (strcmp(arg, "set") == 0) {
+      command->type = CommandSetCue;
+    }
+    else {
+      char* end = NULL;
+      command->offset = strtol(arg, &end, 10) - 1;
+      if (end == arg || *end != 0 || command->offset < 0 || command->offset >= MAX_CUES) {
+        return Error;
+      }
+      command->type = CommandCue;
+    }
+  }
+  else if (strcmp(name, "volume") == 0 && count == 2) {
+    char* end = NULL;
+    command->amount = strtof(arg, &end);
+    if (end == arg || *end != 0) {
+      return Error;
+    }
+    command->type = relative ? CommandVolumeBy : CommandVolume;
+  }
+  else if (strcmp(name, "next") == 0 && count == 2) {
+    command->type = CommandJump;
+    if (strcmp(arg, "high") == 0) {
+      command->offset = BlockHighEntropy;
+    }
+    else if (strcmp(arg, "low") == 0) {
+      command->offset = BlockLowEntropy;
+    }
+    else if (strcmp(arg, "text") == 0) {
+      command->offset = BlockText;
+    }
+    else {
+      return Error;
+    }
+  }
+  else if (strcmp(name, "status") == 0) {
+    command->type = CommandStatus;
+  }
+  else if (strcmp(name, "quit") == 0) {
+    command->type = CommandQuit;
+  }
+  else {
+    return Error;
+  }
+  return NoError;
+}
+
+// Called from the ui thread. Anything the audio thread reads goes through the command queue,
+// settings that are only shown (volume, loop) are kept in sync in g_volume and g_loop_after_complete.
+// CommandStatus is left to whoever reports status.
+// Why a parsed command can't be carried out in this session, or NULL if it can
+const char* binplay_command_error(const Command* command) {
+  if (command->type == CommandJump && g_headless) {
+    return "no block index in headless mode"; // the index workers only run for the ui
+  }
+  return NULL;
+}
+
+void binplay_command(Binplay* b, const Command* command) {
+  Command forward = *command;
+  switch (command->type) {
+    case CommandPlay:
+    case CommandPause:
+    case CommandTogglePause: {
+      break;
+    }
+    case CommandSeek: {
+      prefetch_record_step(b, command->offset - binplay_cursor(b));
+      break;
+    }
+    case CommandSeekBy: {
+      prefetch_record_step(b, command->offset);
+      break;
+    }
+    case CommandLoop: {
+      g_loop_after_complete = command->amount < 0 ? !g_loop_after_complete : command->amount > 0;
+      forward.amount = g_loop_after_complete;
+      break;
+    }
+    case CommandVolume: {
+      g_volume = CLAMP(command->amount, 0.0f, 1.0f);
+      forward.amount = g_volume;
+      break;
+    }
+    case CommandVolumeBy: {
+      g_volume = CLAMP(g_volume + command->amount, 0.0f, 1.0f);
+      forward.type = CommandVolume;
+      forward.amount = g_volume;
+      break;
+    }
+    case CommandJump: {
+      binplay_jump_to_block(b, (Block_kind)command->offset);
+      return;
+    }
+    case CommandCue: {
+      if (command->offset >= atomic_load_explicit(&b->cues.count, memory_order_relaxed)) {
+        return;
+      }
+      break;
+    }
+    case CommandSetCue: {
+      cue_add(b, binplay_cursor(b));
+      return;
+    }
+    case CommandRegion: {
+      b->marker_a = command->offset < 0 ? -1 : command->offset;
+      b->marker_b = command->end < 0 ? -1 : command->end;
+      break;
+    }
+    case CommandQuit: {
+      atomic_store(&b->done, 1);
+      return;
+    }
+    default:
+      return;
+  }
+  command_queue_push(&b->commands, &forward);
+}
+
+Result command_queue_push(Command_queue* queue, const Command* command) {
+  u32 head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  u32 tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+  if (head - tail >= COMMAND_QUEUE_SIZE) {
+    atomic_fetch_add_explicit(&queue->dropped, 1, memory_order_relaxed);
+    return Error;
+  }
+  queue->slots[head & (COMMAND_QUEUE_SIZE - 1)] = *command;
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+  return NoError;
+}
+
+u8 command_queue_pop(Command_queue* queue, Command* command) {
+  u32 tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  u32 head = atomic_load_explicit(&queue->head, memory_order_acquire);
+  if (head == tail) {
+    return 0;
+  }
+  *command = queue->slots[tail & (COMMAND_QUEUE_SIZE - 1)];
+  atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+  return 1;
+}
+
+// Called at the start of every callback. All seeks that queued up since the last callback,
+// like a held down arrow key, collapse into a single seek of every source.
+void binplay_apply_commands(Binplay* b) {
+  Audio_state* audio = &b->audio;
+  Source* primary = &b->sources[0];
+  i64 target = primary->cursor;
+  u8 seek = 0;
+  i32 cue = -1;  // the seek lands on this cue
+  u8 user_seek = 0;  // the seek was asked for, counted in the prefetch hit rate
+  u8 region = 0;
+  i64 region_start = -1;
+  i64 region_end = -1;
+  u8 applied = 0;
+  Command command;
+  while (command_queue_pop(&b->commands, &command)) {
+    applied = 1;
+    switch (command.type) {
+      case CommandPlay: {
+        audio->play = 1;
+        break;
+      }
+      case CommandPause: {
+        audio->play = 0;
+        break;
+      }
+      case CommandTogglePause: {
+        audio->play = !audio->play;
+        break;
+      }
+      case CommandLoop: {
+        audio->loop = command.amount > 0;
+        break;
+      }
+      case CommandVolume: {
+        audio->volume = command.amount;
+        break;
+      }
+      case CommandSeek: {
+        target = command.offset;
+        seek = 1;
+        cue = -1;
+        user_seek = 1;
+        break;
+      }
+      case CommandSeekBy: {
+        target += command.offset;
+        seek = 1;
+        cue = -1;
+        user_seek = 1;
+        break;
+      }
+      case CommandCue: {
+        cue = command.offset;
+        user_seek = 0;
+        target = b->cues.cues[cue].offsets[0];
+        seek = 1;
+        break;
+      }
+      case CommandRegion: {
+        region = 1;
+        region_start = command.offset;
+        region_end = command.end;
+        break;
+      }
+      default:
+        break;
+    }
+  }
+  if (region) {
+    // The region is in offsets of the first source, every source loops over the same part of its data
+    const i64 start = region_start - primary->start_pos;
+    const i64 end = region_end - primary->start_pos;
+    audio->region = region_start >= 0 && region_end >= 0 && source_offset(primary, end) > source_offset(primary, start);
+    u8 changed = 0;
+    u8 keep_ring = 1;
+    for (u32 i = 0; i < b->source_count; ++i) {
+      Source* s = &b->sources[i];
+      const i64 new_start = audio->region ? source_offset(s, start) : s->start_pos;
+      const i64 new_end = audio->region ? source_offset(s, end) : s->file_size;
+      if (new_start == s->region_start && new_end == s->region_end) {
+        continue;
+      }
+      // The reader is at most a ring ahead of the cursor and picks up new bounds before its next
+      // read, so the read-ahead stays valid if that much past the cursor reaches neither end
+      const i64 end_before = s->region_end < new_end ? s->region_end : new_end;
+      if (s->synced_gen != s->gen || s->prefix_used != s->prefix_size || s->cursor < new_start || s->cursor + READ_AHEAD_SIZE > end_before) {
+        keep_ring = 0;
+      }
+      s->region_start = new_start;
+      s->region_end = new_end;
+      changed = 1;
+    }
+    if (changed && keep_ring) {
+      for (u32 i = 0; i < b->source_count; ++i) {
+        source_publish_region(&b->sources[i]);
+      }
+    }
+    // Otherwise the reader learns about the region with a seek, stay where we are if that is inside it
+    else if (changed && !seek) {
+      target = primary->cursor;
+      seek = 1;
+    }
+  }
+  Prefetcher* prefetch = &b->prefetch;
+  const i32 pinned = prefetch->pinned;
+  const Cue* c = cue >= 0 && (u32)cue < atomic_load_explicit(&b->cues.count, memory_order_acquire) ? &b->cues.cues[cue] : NULL;
+  i32 slot = -1;
+  if (seek && user_seek) {
+    const i64 position = CLAMP(source_offset(primary, target - primary->start_pos), primary->region_start, primary->region_end);
+    slot = prefetch_acquire(b, position);
+    atomic_fetch_add_explicit(slot >= 0 ? &prefetch->hits : &prefetch->misses, 1, memory_order_relaxed);
+  }
+  if (seek && c && c->offsets[0] >= primary->region_start && c->offsets[0] + c->sizes[0] <= primary->region_end) {
+    // Play the cached start of the cue while the reader catches up behind it
+    for (u32 i = 0; i < b->source_count; ++i) {
+      source_seek_cached(&b->sources[i], c->offsets[i], c->data[i], c->sizes[i]);
+    }
+  }
+  else if (slot >= 0) {
+    // Same as below, but the first bytes come from the prefetched window
+    const Prefetch_slot* p = &prefetch->slots[slot];
+    const i64 offset = target - primary->start_pos;
+    for (u32 i = 0; i < b->source_count; ++i) {
+      Source* s = &b->sources[i];
+      const i64 frame_size = s->sample_size * s->channel_count;
+      i64 position = source_offset(s, offset);
+      position = CLAMP(position, s->region_start, s->region_end);
+      const i64 skip = position - p->offsets[i];
+      if (skip < 0 || skip >= p->sizes[i]) {
+        source_seek(s, position);
+        continue;
+      }
+      i64 size = p->sizes[i] - skip;
+      if (size > s->region_end - position) {
+        size = ((s->region_end - position) / frame_size) * frame_size;
+      }
+      source_seek_cached(s, position, &p->data[i][skip], size);
+    }
+  }
+  else if (seek) {
+    // Move every source to the same offset into its data, kept inside the loop region
+    const i64 offset = target - primary->start_pos;
+    for (u32 i = 0; i < b->source_count; ++i) {
+      Source* s = &b->sources[i];
+      i64 position = source_offset(s, offset);
+      position = CLAMP(position, s->region_start, s->region_end);
+      source_seek(s, position);
+    }
+  }
+  // The previous window is no longer played from after any other seek
+  if (seek && pinned >= 0 && slot != pinned) {
+    prefetch_release(b);
+  }
+  if (slot >= 0) {
+    prefetch->pinned = slot;
+  }
+  if (prefetch->pinned >= 0) {
+    u8 played = 1;
+    for (u32 i = 0; i < b->source_count; ++i) {
+      played = played && b->sources[i].prefix_used == b->sources[i].prefix_size;
+    }
+    if (played) {
+      prefetch_release(b);
+    }
+  }
+  if (applied) {
+    binplay_notify_ui(b);
+  }
+}
+
+// Last cursor published by the audio thread
+i64 binplay_cursor(Binplay* b) {
+  return atomic_load_explicit(&b->position.cursor, memory_order_relaxed);
+}
+
+u8 binplay_playing(Binplay* b) {
+  return atomic_load_explicit(&b->position.playing, memory_order_relaxed);
+}
+
+// One json object per line, so supervisors can tail the stream without a parser for partial writes.
+// Only reads state the audio thread publishes, so it is safe from any thread.
+u32 binplay_format_status(Binplay* b, char* text, u32 size, f64 now, u64* last_frames, f64* last_time) {
+  const i64 frame_size = g_sample_size * g_channel_count;
+  const i64 cursor = binplay_cursor(b);
+  const char* state = binplay_playing(b) ? "playing" : (cursor >= b->file_size ? "ended" : "paused");
+  const u64 frames = atomic_load_explicit(&b->profile.frames, memory_order_relaxed);
+  const f64 elapsed = now - *last_time;
+  const f64 frames_per_second = elapsed > 0.0 ? (frames - *last_frames) / elapsed : 0.0;
+  *last_frames = frames;
+  *last_time = now;
+  f32 engine_load = atomic_load_explicit(&b->engine_load, memory_order_relaxed);
+  if (stream && g_engine == EngineCallback) {
+    engine_load = Pa_GetStreamCpuLoad(stream);
+  }
+  u32 starved = 0;
+  for (u32 i = 0; i < b->source_count; ++i) {
+    starved += atomic_load_explicit(&b->sources[i].starved, memory_order_relaxed);
+  }
+  const i64 start = b->sources[0].start_pos;
+  const u32 prefetch_hits = atomic_load_explicit(&b->prefetch.hits, memory_order_relaxed);
+  const u32 prefetch_misses = atomic_load_explicit(&b->prefetch.misses, memory_order_relaxed);
+  i32 length = snprintf(text, size,
+    "{\"time\": %.3f, \"state\": \"%s\", \"cursor\": %lld, \"size\": %lld, \"progress\": %.4f, "
+    "\"position\": %.3f, \"duration\": %.3f, \"volume\": %.2f, \"loop\": %s, "
+    "\"underflows\": %u, \"overflows\": %u, \"starved\": %u, "
+    "\"frames_per_second\": %.1f, \"bytes_per_second\": %.1f, \"cpu_load\": %.4f, "
+    "\"prefetch_hits\": %u, \"prefetch_misses\": %u, \"prefetch_hit_rate\": %.4f}\n",
+    now,
+    state,
+    (long long)cursor,
+    (long long)b->file_size,
+    b->file_size > start ? (f64)(cursor - start) / (b->file_size - start) : 0.0,
+    (f64)(cursor - start) / frame_size / g_sample_rate,
+    (f64)(b->file_size - start) / frame_size / g_sample_rate,
+    atomic_load_explicit(&b->position.volume, memory_order_relaxed),
+    atomic_load_explicit(&b->position.loop, memory_order_relaxed) ? "true" : "false",
+    atomic_load_explicit(&b->xruns.underflows, memory_order_relaxed),
+    atomic_load_explicit(&b->xruns.overflows, memory_order_relaxed),
+    starved,
+    frames_per_second,
+    frames_per_second * frame_size,
+    engine_load,
+    prefetch_hits,
+    prefetch_misses,
+    prefetch_hits + prefetch_misses ? (f64)prefetch_hits / (prefetch_hits + prefetch_misses) : 0.0
+  );
+  return length < 0 ? 0 : (length >= (i32)size ? size - 1 : (u32)length);
+}
+
+void binplay_write_status(Binplay* b, FILE* fp, f64 now, u64* last_frames, f64* last_time) {
+  char status[MAX_STATUS_SIZE];
+  u32 size = binplay_format_status(b, status, sizeof(status), now, last_frames, last_time);
+  fwrite(status, 1, size, fp);
+  fflush(fp);
+}
+
+// A byte offset, or seconds with an 's' suffix
+Result offset_parse(const char* text, i64* offset) {
+  char* end = NULL;
+  f64 value = strtod(text, &end);
+  if (end == text || (*end != 0 && strcmp(end, "s") != 0)) {
+    return Error;
+  }
+  if (*end == 's') {
+    value *= (f64)g_sample_rate * g_channel_count * g_sample_size;
+  }
+  *offset = (i64)value;
+  return NoError;
+}
+
+i64 cue_prefetch_size(const Source* s) {
+  return ((i64)g_sample_rate * CUE_PREFETCH_MS / 1000) * s->sample_size * s->channel_count;
+}
+
+// Called from the ui thread. Reads the start of every source at `offset` into memory and
+// publishes the cue to the audio thread.
+Result cue_add(Binplay* b, i64 offset) {
+  Cue_list* list = &b->cues;
+  const u32 index = atomic_load_explicit(&list->count, memory_order_relaxed);
+  if (index >= MAX_CUES) {
+    return Error;
+  }
+  Cue* cue = &list->cues[index];
+  const Source* primary = &b->sources[0];
+  const i64 data_offset = offset - primary->start_pos;
+  for (u32 i = 0; i < b->source_count; ++i) {
+    const Source* s = &b->sources[i];
+    const i64 frame_size = s->sample_size * s->channel_count;
+    cue->offsets[i] = source_offset(s, data_offset);
+
+    // Only the part inside the loop region (or the range) is read ahead
+    i64 prefetch = cue_prefetch_size(s);
+    const i64 end = atomic_load_explicit(&s->seek_region_end, memory_order_relaxed);
+    if (prefetch > end - cue->offsets[i]) {
+      prefetch = end - cue->offsets[i];
+    }
+    cue->sizes[i] = 0;
+    if (prefetch > 0 && (cue->data[i] = arena_push(&b->arena, prefetch))) {
+      ssize_t bytes_read = pread(s->fd, cue->data[i], prefetch, cue->offsets[i]);
+      // A short read only means a shorter head start
+      cue->sizes[i] = bytes_read > 0 ? (bytes_read / frame_size) * frame_size : 0;
+      if (bytes_read == prefetch) {
+        cue->sizes[i] = bytes_read;
+      }
+    }
+  }
+  atomic_store_explicit(&list->count, index + 1, memory_order_release);
+  return NoError;
+}
+
+Result cue_load(Binplay* b, const char* path) {
+  Result result = NoError;
+  FILE* fp = fopen(path, "r");
+  if (!fp) {
+    fprintf(stderr, "Failed to open cue file '%s'\n", path);
+    return_defer(Error);
+  }
+  char line[MAX_COMMAND_LINE_SIZE];
+  u32 line_number = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    line_number += 1;
+    char text[MAX_COMMAND_LINE_SIZE] = {0};
+    if (sscanf(line, " %255s", text) != 1 || text[0] == '#') {
+      continue;
+    }
+    i64 offset = 0;
+    if (offset_parse(text, &offset) != NoError) {
+      fprintf(stderr, "%s:%u: invalid cue offset '%s'\n", path, line_number, text);
+      return_defer(Error);
+    }
+    if (cue_add(b, offset) != NoError) {
+      fprintf(stderr, "%s:%u: too many cues (max %d)\n", path, line_number, MAX_CUES);
+      return_defer(Error);
+    }
+  }
+defer:
+  if (fp) {
+    fclose(fp);
+  }
+  return result;
+}
+
+// Called once the audio thread is stopped
+void cue_free(Binplay* b) {
+  Cue_list* list = &b->cues;
+  const u32 count = atomic_load(&list->count);
+  for (u32 c = 0; c < count; ++c) {
+    for (u32 i = 0; i < MAX_SOURCES; ++i) {
+      list->cues[c].data[i] = NULL;
+    }
+  }
+  atomic_store(&list->count, 0);
+}
+
+// Returns 1 if the text changed
+u8 cue_list_render(Binplay* b) {
+  Cue_list* list = &b->cues;
+  const u32 count = atomic_load_explicit(&list->count, memory_order_relaxed);
+  if (list->rendered && list->rendered_count == count) {
+    return 0;
+  }
+  list->rendered = 1;
+  list->rendered_count = count;
+  const i64 frame_size = g_sample_size * g_channel_count;
+  char* it = &list->text[0];
+  char* end = &list->text[CUE_TEXT_SIZE];
+  it += snprintf(it, end - it, "Cues (%u/%d):\n", count, MAX_CUES);
+  for (u32 c = 0; c < count; ++c) {
+    const i64 offset = list->cues[c].offsets[0];
+    const f64 seconds = (f64)(offset - b->sources[0].start_pos) / frame_size / g_sample_rate;
+    it += snprintf(it, end - it, "  [%u] 0x%08llx (%.2f s)\n", (c + 1) % MAX_CUES, (unsigned long long)offset, seconds);
+  }
+  return 1;
+}
+
+Result prefetch_start(Binplay* b) {
+  Prefetcher* prefetch = &b->prefetch;
+  for (u32 slot = 0; slot < PREFETCH_SLOTS; ++slot) {
+    for (u32 i = 0; i < b->source_count; ++i) {
+      if (!(prefetch->slots[slot].data[i] = arena_push(&b->arena, prefetch_window_size(&b->sources[i])))) {
+        prefetch_stop(b);
+        return Error;
+      }
+    }
+  }
+  if (pthread_create(&prefetch->worker, NULL, prefetch_thread, b) != 0) {
+    prefetch_stop(b);
+    return Error;
+  }
+  prefetch->worker_running = 1;
+  return NoError;
+}
+
+i64 prefetch_window_size(const Source* s) {
+  return ((i64)g_sample_rate * PREFETCH_WINDOW_MS / 1000) * s->sample_size * s->channel_count;
+}
+
+// Called once the audio thread is stopped
+void prefetch_stop(Binplay* b) {
+  Prefetcher* prefetch = &b->prefetch;
+  if (prefetch->worker_running) {
+    binplay_wake_workers(b);
+    pthread_join(prefetch->worker, NULL);
+    prefetch->worker_running = 0;
+  }
+  for (u32 slot = 0; slot < PREFETCH_SLOTS; ++slot) {
+    for (u32 i = 0; i < MAX_SOURCES; ++i) {
+      prefetch->slots[slot].data[i] = NULL;
+    }
+    atomic_store(&prefetch->slots[slot].state, SlotEmpty);
+  }
+  prefetch->pinned = -1;
+}
+
+// Whether a seek to `position` of the first source can start from the slot: at least a margin
+// of audio after it, or all that is left up to the end of the region
+u8 prefetch_covers(const Prefetch_slot* p, i64 position, i64 margin, i64 region_end) {
+  const i64 end = p->offsets[0] + p->sizes[0];
+  return position >= p->offsets[0] && position < end && (position + margin <= end || end >= region_end);
+}
+
+// Keeps a window of every likely seek target in memory: the steps seen most in the last seeks,
+// the seek keys and the start of the region. Slots that no longer cover a target are reused.
+void* prefetch_thread(void* userdata) {
+  Binplay* b = (Binplay*)userdata;
+  Prefetcher* prefetch = &b->prefetch;
+  const Source* primary = &b->sources[0];
+  const i64 margin = ((i64)g_sample_rate * PREFETCH_MARGIN_MS / 1000) * primary->sample_size * primary->channel_count;
+  while (!atomic_load(&b->done)) {
+    // Taken before the pass, so that a seek or cursor move during it is not slept through
+    const u32 wake = atomic_load(&b->wake_gen);
+    const i64 cursor = binplay_cursor(b);
+    const i64 region_start = atomic_load_explicit(&primary->seek_region_start, memory_order_relaxed);
+    const i64 region_end = atomic_load_explicit(&primary->seek_region_end, memory_order_relaxed);
+
+    // The two most frequent recent steps, ties go to the newer one
+    const u32 step_count = atomic_load_explicit(&prefetch->step_count, memory_order_acquire);
+    const u32 history = step_count < SEEK_HISTORY ? step_count : SEEK_HISTORY;
+    i64 history_steps[SEEK_HISTORY];
+    for (u32 i = 0; i < history; ++i) {
+      history_steps[i] = atomic_load_explicit(&prefetch->steps[(step_count - 1 - i) % SEEK_HISTORY], memory_order_relaxed);
+    }
+    i64 steps[2] = {0};
+    u32 seen[2] = {0};
+    for (u32 i = 0; i < history; ++i) {
+      const i64 step = history_steps[i];
+      if (step == 0 || (seen[0] && step == steps[0]) || (seen[1] && step == steps[1])) {
+        continue;
+      }
+      u32 n = 0;
+      for (u32 j = 0; j < history; ++j) {
+        n += history_steps[j] == step;
+      }
+      if (n > seen[0]) {
+        steps[1] = steps[0];
+        seen[1] = seen[0];
+        steps[0] = step;
+        seen[0] = n;
+      }
+      else if (n > seen[1]) {
+        steps[1] = step;
+        seen[1] = n;
+      }
+    }
+
+    // In order of priority, the first PREFETCH_SLOTS targets are kept
+    i64 targets[PREFETCH_SLOTS];
+    u32 target_count = 0;
+    const i64 speed = g_cursor_speed;
+    const i64 candidates[] = {
+      cursor + steps[0], cursor + 2 * steps[0],
+      cursor + speed, cursor - speed,
+      cursor + 2 * speed, cursor - 2 * speed,
+      region_start,
+      cursor + steps[1],
+    };
+    const u8 enabled[] = { seen[0] > 0, seen[0] > 0, 1, 1, 1, 1, 1, seen[1] > 0, };
+    for (u32 i = 0; i < ARR_SIZE(candidates) && target_count < PREFETCH_SLOTS; ++i) {
+      if (enabled[i]) {
+        const i64 last = region_end - margin > region_start ? region_end - margin : region_start;
+        targets[target_count++] = source_offset(primary, CLAMP(candidates[i], region_start, last) - primary->start_pos);
+      }
+    }
+
+    // Keep the slots that still cover a target, load the missing ones into the others
+    u8 wanted[PREFETCH_SLOTS] = {0};
+    for (u32 t = 0; t < target_count; ++t) {
+      for (u32 slot = 0; slot < PREFETCH_SLOTS; ++slot) {
+        const i32 state = atomic_load_explicit(&prefetch->slots[slot].state, memory_order_relaxed);
+        if ((state == SlotReady || state == SlotPinned) && prefetch_covers(&prefetch->slots[slot], targets[t], margin, region_end)) {
+          wanted[slot] = 1;
+        }
+      }
+    }
+    for (u32 t = 0; t < target_count && !atomic_load(&b->done); ++t) {
+      u8 covered = 0;
+      for (u32 slot = 0; slot < PREFETCH_SLOTS && !covered; ++slot) {
+        const i32 state = atomic_load_explicit(&prefetch->slots[slot].state, memory_order_relaxed);
+        covered = (state == SlotReady || state == SlotPinned) && prefetch_covers(&prefetch->slots[slot], targets[t], margin, region_end);
+      }
+      if (covered) {
+        continue;
+      }
+      Prefetch_slot* p = NULL;
+      for (u32 slot = 0; slot < PREFETCH_SLOTS && !p; ++slot) {
+        i32 ready = SlotReady;
+        i32 empty = SlotEmpty;
+        if (!wanted[slot] && (atomic_compare_exchange_strong(&prefetch->slots[slot].state, &ready, SlotLoading) ||
+                              atomic_compare_exchange_strong(&prefetch->slots[slot].state, &empty, SlotLoading))) {
+          p = &prefetch->slots[slot];
+          wanted[slot] = 1;
+        }
+      }
+      if (!p) {
+        break;
+      }
+      for (u32 i = 0; i < b->source_count; ++i) {
+        const Source* s = &b->sources[i];
+        const i64 frame_size = s->sample_size * s->channel_count;
+        i64 size = prefetch_window_size(s);
+        p->offsets[i] = source_offset(s, targets[t] - primary->start_pos);
+        // Nothing past the end of the loop region (or the range) is read
+        const i64 end = atomic_load_explicit(&s->seek_region_end, memory_order_relaxed);
+        if (size > end - p->offsets[i]) {
+          size = end - p->offsets[i];
+        }
+        ssize_t bytes_read = size > 0 ? pread(s->fd, p->data[i], size, p->offsets[i]) : 0;
+        p->sizes[i] = bytes_read > 0 ? (bytes_read / frame_size) * frame_size : 0;
+        if (bytes_read == size && size > 0) {
+          p->sizes[i] = bytes_read;
+        }
+      }
+      atomic_store_explicit(&p->state, SlotReady, memory_order_release);
+    }
+    // At most one pass per interval while playing, and none at all while nothing moves
+    usleep(PREFETCH_INTERVAL_US);
+    if (!atomic_load(&b->done)) {
+      binplay_wait_workers(b, wake, NULL);
+    }
+  }
+  return NULL;
+}
+
+// Called from the ui thread with the distance of every seek it sends
+void prefetch_record_step(Binplay* b, i64 step) {
+  Prefetcher* prefetch = &b->prefetch;
+  const u32 count = atomic_load_explicit(&prefetch->step_count, memory_order_relaxed);
+  atomic_store_explicit(&prefetch->steps[count % SEEK_HISTORY], step, memory_order_relaxed);
+  atomic_store_explicit(&prefetch->step_count, count + 1, memory_order_release);
+}
+
+// Called from the audio thread. Pins a slot holding `position` of the first source, or returns -1.
+i32 prefetch_acquire(Binplay* b, i64 position) {
+  Prefetcher* prefetch = &b->prefetch;
+  const Source* primary = &b->sources[0];
+  const i64 margin = ((i64)g_sample_rate * PREFETCH_MARGIN_MS / 1000) * primary->sample_size * primary->channel_count;
+  if (prefetch->pinned >= 0 && prefetch_covers(&prefetch->slots[prefetch->pinned], position, margin, primary->region_end)) {
+    return prefetch->pinned;
+  }
+  for (u32 slot = 0; slot < PREFETCH_SLOTS; ++slot) {
+    Prefetch_slot* p = &prefetch->slots[slot];
+    i32 ready = SlotReady;
+    // Pinned first, so the prefetcher can't reload the slot while it is looked at
+    if (!atomic_compare_exchange_strong_explicit(&p->state, &ready, SlotPinned, memory_order_acquire, memory_order_relaxed)) {
+      continue;
+    }
+    if (prefetch_covers(p, position, margin, primary->region_end)) {
+      return slot;
+    }
+    atomic_store_explicit(&p->state, SlotReady, memory_order_release);
+  }
+  return -1;
+}
+
+// Called from the audio thread once nothing plays from the pinned slot anymore
+void prefetch_release(Binplay* b) {
+  Prefetcher* prefetch = &b->prefetch;
+  if (prefetch->pinned >= 0) {
+    atomic_store_explicit(&prefetch->slots[prefetch->pinned].state, SlotReady, memory_order_release);
+    prefetch->pinned = -1;
+  }
+}
+
+// Applies the commands that came in over the control socket, from the ui thread
+void binplay_drain_remote(Binplay* b) {
+  Command command;
+  while (command_queue_pop(&b->remote, &command)) {
+    binplay_command(b, &command);
+  }
+}
+
+Result control_start(Binplay* b) {
+  Result result = NoError;
+  Control_server* control = &b->control;
+  struct sockaddr_un address = { .sun_family = AF_UNIX, };
+  if (strlen(g_control_path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Control socket path '%s' is too long\n", g_control_path);
+    return_defer(Error);
+  }
+  strcpy(address.sun_path, g_control_path);
+  if ((control->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+    fprintf(stderr, "Failed to create the control socket: %s\n", strerror(errno));
+    return_defer(Error);
+  }
+  // A socket left behind by an earlier run would make bind() fail, anything else there is
+  // not ours to remove
+  struct stat st;
+  if (lstat(g_control_path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "Control socket path '%s' exists and is not a socket\n", g_control_path);
+      return_defer(Error);
+    }
+    unlink(g_control_path);
+  }
+  if (bind(control->listen_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+    fprintf(stderr, "Failed to listen on '%s': %s\n", g_control_path, strerror(errno));
+    return_defer(Error);
+  }
+  control->bound = 1;
+  if (listen(control->listen_fd, 16) < 0) {
+    fprintf(stderr, "Failed to listen on '%s': %s\n", g_control_path, strerror(errno));
+    return_defer(Error);
+  }
+  if ((control->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+    (control->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+    (control->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+    fprintf(stderr, "Failed to set up the control socket loop: %s\n", strerror(errno));
+    return_defer(Error);
+  }
+  const f32 rate = CLAMP(g_status_rate, 0.01f, 1000.0f);
+  const u64 interval_ns = (u64)(1e9 / rate);
+  struct itimerspec interval = {0};
+  interval.it_interval.tv_sec = interval_ns / 1000000000ULL;
+  interval.it_interval.tv_nsec = interval_ns % 1000000000ULL;
+  interval.it_value = interval.it_interval;
+  timerfd_settime(control->timer_fd, 0, &interval, NULL);
+
+  // Clients are tagged with their slot, the other descriptors with the slots after them
+  const i32 fds[] = { control->listen_fd, control->wake_fd, control->timer_fd, };
+  for (u32 i = 0; i < ARR_SIZE(fds); ++i) {
+    struct epoll_event event = { .events = EPOLLIN, .data.u64 = MAX_CONTROL_CLIENTS + i, };
+    epoll_ctl(control->epoll_fd, EPOLL_CTL_ADD, fds[i], &event);
+  }
+  if (pthread_create(&control->thread, NULL, control_thread, b) != 0) {
+    fprintf(stderr, "Failed to start the control thread\n");
+    return_defer(Error);
+  }
+  control->running = 1;
+defer:
+  if (result != NoError) {
+    control_stop(b);
+  }
+  return result;
+}
+
+void control_stop(Binplay* b) {
+  Control_server* control = &b->control;
+  if (control->running) {
+    eventfd_write(control->wake_fd, 1);
+    pthread_join(control->thread, NULL);
+    control->running = 0;
+  }
+  for (u32 i = 0; i < MAX_CONTROL_CLIENTS; ++i) {
+    control_close_client(control, &control->clients[i]);
+  }
+  const i32 fds[] = { control->listen_fd, control->epoll_fd, control->wake_fd, control->timer_fd, };
+  for (u32 i = 0; i < ARR_SIZE(fds); ++i) {
+    if (fds[i] >= 0) {
+      close(fds[i]);
+    }
+  }
+  if (control->bound) {
+    unlink(g_control_path);
+    control->bound = 0;
+  }
+  control->listen_fd = control->epoll_fd = control->wake_fd = control->timer_fd = -1;
+}
+
+void* control_thread(void* userdata) {
+  Binplay* b = (Binplay*)userdata;
+  Control_server* control = &b->control;
+  struct epoll_event events[16];
+  while (!atomic_load(&b->done)) {
+    i32 count = epoll_wait(control->epoll_fd, events, ARR_SIZE(events), -1);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    for (i32 i = 0; i < count; ++i) {
+      const u64 tag = events[i].data.u64;
+      if (tag < MAX_CONTROL_CLIENTS) {
+        control_read(b, &control->clients[tag]);
+      }
+      else if (tag == MAX_CONTROL_CLIENTS) {
+        control_accept(b);
+      }
+      else if (tag == MAX_CONTROL_CLIENTS + 2) {
+        u64 expirations = 0;
+        if (read(control->timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+          continue;
+        }
+        char status[MAX_STATUS_SIZE];
+        u32 size = 0;
+        for (u32 c = 0; c < MAX_CONTROL_CLIENTS; ++c) {
+          Control_client* client = &control->clients[c];
+          if (client->fd >= 0 && client->subscribed) {
+            if (size == 0) {
+              size = binplay_format_status(b, status, sizeof(status), cpu_time_now(CLOCK_MONOTONIC) - b->start_time, &control->last_frames, &control->last_time);
+            }
+            control_send(control, client, status, size);
+          }
+        }
+      }
+    }
+  }
+  return NULL;
+}
+
+void control_accept(Binplay* b) {
+  Control_server* control = &b->control;
+  i32 fd = -1;
+  while ((fd = accept(control->listen_fd, NULL, NULL)) >= 0) {
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    Control_client* client = NULL;
+    for (u32 i = 0; i < MAX_CONTROL_CLIENTS && !client; ++i) {
+      if (control->clients[i].fd < 0) {
+        client = &control->clients[i];
+      }
+    }
+    if (!client) {
+      close(fd);
+      continue;
+    }
+    struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP, .data.u64 = client - &control->clients[0], };
+    if (epoll_ctl(control->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+      close(fd);
+      continue;
+    }
+    client->fd = fd;
+    client->subscribed = 0;
+    client->line_size = 0;
+  }
+}
+
+void control_read(Binplay* b, Control_client* client) {
+  Control_server* control = &b->control;
+  if (client->fd < 0) {
+    return;
+  }
+  ssize_t bytes_read = read(client->fd, &client->line[client->line_size], sizeof(client->line) - 1 - client->line_size);
+  if (bytes_read <= 0) {
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EINTR)) {
+      return;
+    }
+    control_close_client(control, client);
+    return;
+  }
+  client->line_size += bytes_read;
+  client->line[client->line_size] = 0;
+  char* it = &client->line[0];
+  char* newline = NULL;
+  u8 forwarded = 0;
+  while ((newline = strchr(it, '\n')) && client->fd >= 0) {
+    *newline = 0;
+    if (newline > it && newline[-1] == '\r') {
+      newline[-1] = 0;
+    }
+    static const char ok[] = "{\"ok\": true}\n";
+    Command command;
+    if (strcmp(it, "subscribe") == 0 || strcmp(it, "unsubscribe") == 0) {
+      client->subscribed = it[0] == 's';
+      control_send(control, client, ok, sizeof(ok) - 1);
+    }
+    else if (command_parse(it, &command) != NoError) {
+      static const char unknown[] = "{\"error\": \"unknown command\"}\n";
+      control_send(control, client, unknown, sizeof(unknown) - 1);
+    }
+    else if (binplay_command_error(&command)) {
+      char error[MAX_STATUS_SIZE];
+      i32 size = snprintf(error, sizeof(error), "{\"error\": \"%s\"}\n", binplay_command_error(&command));
+      control_send(control, client, error, size);
+    }
+    else if (command.type == CommandStatus) {
+      // Answered here without touching the throughput window of the subscribers
+      char status[MAX_STATUS_SIZE];
+      u64 frames = control->last_frames;
+      f64 time = control->last_time;
+      u32 size = binplay_format_status(b, status, sizeof(status), cpu_time_now(CLOCK_MONOTONIC) - b->start_time, &frames, &time);
+      control_send(control, client, status, size);
+    }
+    else if (command_queue_push(&b->remote, &command) != NoError) {
+      static const char busy[] = "{\"error\": \"busy\"}\n";
+      control_send(control, client, busy, sizeof(busy) - 1);
+    }
+    else {
+      forwarded = 1;
+      control_send(control, client, ok, sizeof(ok) - 1);
+    }
+    it = newline + 1;
+  }
+  if (forwarded) {
+    eventfd_write(b->event_fd, 1);
+  }
+  if (client->fd < 0) {
+    return;
+  }
+  client->line_size -= it - &client->line[0];
+  memmove(&client->line[0], it, client->line_size);
+  if (client->line_size >= sizeof(client->line) - 1) {
+    client->line_size = 0; // drop lines that are too long to be a command
+  }
+}
+
+// Lines that don't fit in the socket buffer of a slow client are dropped, a client that went
+// away is closed
+void control_send(Control_server* control, Control_client* client, const char* text, u32 size) {
+  if (client->fd < 0 || size == 0) {
+    return;
+  }
+  ssize_t written = send(client->fd, text, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+    control_close_client(control, client);
+  }
+}
+
+void control_close_client(Control_server* control, Control_client* client) {
+  if (client->fd < 0) {
+    return;
+  }
+  if (control->epoll_fd >= 0) {
+    epoll_ctl(control->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+  }
+  close(client->fd);
+  client->fd = -1;
+  client->subscribed = 0;
+  client->line_size = 0;
+}
+
+void on_stop_signal(i32 signal_number) {
+  (void)signal_number;
+  g_stop_requested = 1;
+}
+
+// Runs without termgui: line commands on stdin, json status lines on stdout or g_status_path
+void binplay_exec_headless(Binplay* b) {
+  FILE* fp = stdout;
+  if (g_status_path && !(fp = fopen(g_status_path, "a"))) {
+    fprintf(stderr, "Failed to open '%s' for the status output\n", g_status_path);
+    return;
+  }
+  // Otherwise stdio allocates its buffer with the first status line
+  static char status_buffer[STATUS_BUFFER_SIZE];
+  setvbuf(fp, status_buffer, _IOLBF, sizeof(status_buffer));
+  struct sigaction action = {0};
+  action.sa_handler = on_stop_signal;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  binplay_start_stream(b);
+
+  const f32 rate = CLAMP(g_status_rate, 0.01f, 1000.0f);
+  const u64 interval_ns = (u64)(1e9 / rate);
+  i32 timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  struct itimerspec interval = {0};
+  interval.it_interval.tv_sec = interval_ns / 1000000000ULL;
+  interval.it_interval.tv_nsec = interval_ns % 1000000000ULL;
+  interval.it_value = interval.it_interval;
+  if (timer_fd >= 0) {
+    timerfd_settime(timer_fd, 0, &interval, NULL);
+  }
+  struct pollfd fds[] = {
+    { .fd = STDIN_FILENO, .events = POLLIN, },
+    { .fd = timer_fd, .events = POLLIN, },
+    { .fd = b->event_fd, .events = POLLIN, },
+  };
+
+  const f64 start = b->start_time;
+  f64 last_time = 0.0;
+  u64 last_frames = 0;
+  char line[MAX_COMMAND_LINE_SIZE] = {0};
+  u32 line_size = 0;
+  u8 input_closed = 0;
+  binplay_write_status(b, fp, cpu_time_now(CLOCK_MONOTONIC) - start, &last_frames, &last_time);
+  while (!atomic_load(&b->done) && !g_stop_requested) {
+    if (poll(fds, ARR_SIZE(fds), -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    const f64 now = cpu_time_now(CLOCK_MONOTONIC) - start;
+    u64 count = 0;
+    u8 woken = 0;
+    if ((fds[1].revents & POLLIN) && read(timer_fd, &count, sizeof(count)) == sizeof(count)) {
+      binplay_write_status(b, fp, now, &last_frames, &last_time);
+      woken = 1;
+    }
+    if ((fds[2].revents & POLLIN) && read(b->event_fd, &count, sizeof(count)) == sizeof(count)) {
+      binplay_drain_remote(b);
+      woken = 1;
+    }
+    // Nobody can resume playback once the input is gone, so the end of the file is the end of the run.
+    // Checked on the timer as well, the event may arrive before the audio thread published its position.
+    if (woken && input_closed && !binplay_playing(b) && binplay_cursor(b) >= b->file_size) {
+      atomic_store(&b->done, 1);
+    }
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      ssize_t bytes_read = read(STDIN_FILENO, &line[line_size], sizeof(line) - 1 - line_size);
+      if (bytes_read <= 0) {
+        fds[0].fd = -1;
+        input_closed = 1;
+        if (!binplay_playing(b) && binplay_cursor(b) >= b->file_size) {
+          atomic_store(&b->done, 1);
+        }
+        continue;
+      }
+      line_size += bytes_read;
+      line[line_size] = 0;
+      char* it = &line[0];
+      char* newline = NULL;
+      while ((newline = strchr(it, '\n'))) {
+        *newline = 0;
+        Command command;
+        if (command_parse(it, &command) != NoError) {
+          if (*it) {
+            fprintf(fp, "{\"error\": \"unknown command\", \"time\": %.3f}\n", now);
+            fflush(fp);
+          }
+        }
+        else if (binplay_command_error(&command)) {
+          fprintf(fp, "{\"error\": \"%s\", \"time\": %.3f}\n", binplay_command_error(&command), now);
+          fflush(fp);
+        }
+        else if (command.type == CommandStatus) {
+          // Keep the throughput window of the periodic lines
+          u64 frames = last_frames;
+          f64 time = last_time;
+          binplay_write_status(b, fp, now, &frames, &time);
+        }
+        else {
+          binplay_command(b, &command);
+        }
+        it = newline + 1;
+      }
+      line_size -= it - &line[0];
+      memmove(&line[0], it, line_size);
+      if (line_size >= sizeof(line) - 1) {
+        line_size = 0; // drop lines that are too long to be a command
+      }
+    }
+  }
+  binplay_write_status(b, fp, cpu_time_now(CLOCK_MONOTONIC) - start, &last_frames, &last_time);
+  if (timer_fd >= 0) {
+    close(timer_fd);
+  }
+  if (fp != stdout) {
+    fclose(fp);
+  }
+}
+
+// Safe to call from the audio thread: only sets a flag, the reader thread does the syscall
+void binplay_notify_ui(Binplay* b) {
+  atomic_store_explicit(&b->ui_dirty, 1, memory_order_release);
+}
+
+// Tells the reader and the prefetcher there may be a seek, a cursor move, ring space or ui news.
+// Only enters the kernel when one of them is actually asleep, and a futex wake never blocks,
+// so the audio thread may call it.
+void binplay_wake_workers(Binplay* b) {
+  atomic_fetch_add(&b->wake_gen, 1);
+  if (atomic_load(&b->sleepers)) {
+    syscall(SYS_futex, &b->wake_gen, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+  }
+}
+
+// Sleeps until binplay_wake_workers() was called after `wake` was read from `wake_gen`, or
+// `timeout` passed (NULL to wait for the wake alone)
+void binplay_wait_workers(Binplay* b, u32 wake, const struct timespec* timeout) {
+  atomic_fetch_add(&b->sleepers, 1);
+  syscall(SYS_futex, &b->wake_gen, FUTEX_WAIT_PRIVATE, wake, timeout, NULL, 0);
+  atomic_fetch_sub(&b->sleepers, 1);
+}
+
+void xrun_record(Xrun_stats* xruns, Xrun_kind kind, i64 file_offset) {
+  if (kind == XrunUnderflow) {
+    atomic_fetch_add_explicit(&xruns->underflows, 1, memory_order_relaxed);
+  }
+  else {
+    atomic_fetch_add_explicit(&xruns->overflows, 1, memory_order_relaxed);
+  }
+  u32 index = atomic_load_explicit(&xruns->event_count, memory_order_relaxed);
+  u64 event = ((u64)kind << 63) | ((u64)file_offset & ~(1ull << 63));
+  atomic_store_explicit(&xruns->events[index % MAX_XRUN_EVENTS], event, memory_order_relaxed);
+  atomic_store_explicit(&xruns->event_count, index + 1, memory_order_release);
+}
+
+// Format the counters followed by the offsets of (at most) the `max_events` most recent xruns
+u32 xrun_format(Xrun_stats* xruns, char* buffer, u32 size, u32 max_events) {
+  u32 count = atomic_load_explicit(&xruns->event_count, memory_order_acquire);
+  u32 length = snprintf(buffer, size, "%u underflows, %u overflows",
+    atomic_load_explicit(&xruns->underflows, memory_order_relaxed),
+    atomic_load_explicit(&xruns->overflows, memory_order_relaxed)
+  );
+  if (max_events > MAX_XRUN_EVENTS) {
+    max_events = MAX_XRUN_EVENTS;
+  }
+  u32 first = count > max_events ? count - max_events : 0;
+  for (u32 i = first; i < count && length < size; ++i) {
+    u64 event = atomic_load_explicit(&xruns->events[i % MAX_XRUN_EVENTS], memory_order_relaxed);
+    length += snprintf(&buffer[length], size - length, "%s%s@0x%llx",
+      i == first ? " (last: " : ", ",
+      (event >> 63) == XrunUnderflow ? "u" : "o",
+      (unsigned long long)(event & ~(1ull << 63))
+    );
+  }
+  if (count > 0 && length < size) {
+    length += snprintf(&buffer[length], size - length, ")");
+  }
+  return length;
+}
+
+i32 stereo_callback(const void* in_buffer, void* out_buffer, unsigned long frames_per_buffer, const PaStreamCallbackTimeInfo* time_info, PaStreamCallbackFlags flags, void* user_data) {
+  if (flags & paOutputUnderflow) {
+    xrun_record(&binplay.xruns, XrunUnderflow, binplay.sources[0].cursor);
+  }
+  if (flags & paOutputOverflow) {
+    xrun_record(&binplay.xruns, XrunOverflow, binplay.sources[0].cursor);
+  }
+  if (flags & (paOutputUnderflow | paOutputOverflow)) {
+    binplay_notify_ui(&binplay);
+  }
+  if (g_realtime && !binplay.audio_thread_ready) {
+    rt_setup_audio_thread(&binplay);
+  }
+  if (binplay_process_audio(out_buffer, frames_per_buffer) == NoError) {
+    return paContinue;
   }
   return paComplete;
 }
 
-Result binplay_open_stream(Binplay* b) {
+void device_cache_path(char* path, u32 size) {
+  const char* home = getenv("HOME");
+  if (home) {
+    snprintf(path, size, "%s/%s", home, DEVICE_CACHE_FILE);
+  }
+  else {
+    snprintf(path, size, "%s", DEVICE_CACHE_FILE);
+  }
+}
+
+void device_cache_load(Device_cache* cache) {
+  char path[MAX_FILE_SIZE] = {0};
+  device_cache_path(path, MAX_FILE_SIZE);
+  cache->count = 0;
+  cache->dirty = 0;
+  FILE* fp = fopen(path, "r");
+  if (!fp) {
+    return;
+  }
+  char line[MAX_DEVICE_NAME_SIZE + 64];
+  while (cache->count < MAX_DEVICE_CACHE_ENTRIES && fgets(line, sizeof(line), fp)) {
+    Device_cache_entry* entry = &cache->entries[cache->count];
+    if (sscanf(line, "%127[^\t]\t%d\t%u\t%d\t%hhu", entry->name, &entry->sample_rate, &entry->sample_format, &entry->channel_count, &entry->supported) == 5) {
+      cache->count += 1;
+    }
+  }
+  fclose(fp);
+}
+
+void device_cache_save(Device_cache* cache) {
+  if (!cache->dirty) {
+    return;
+  }
+  char path[MAX_FILE_SIZE] = {0};
+  device_cache_path(path, MAX_FILE_SIZE);
+  FILE* fp = fopen(path, "w");
+  if (!fp) {
+    return;
+  }
+  for (u32 i = 0; i < cache->count; ++i) {
+    Device_cache_entry* entry = &cache->entries[i];
+    fprintf(fp, "%s\t%d\t%u\t%d\t%u\n", entry->name, entry->sample_rate, entry->sample_format, entry->channel_count, entry->supported);
+  }
+  fclose(fp);
+  cache->dirty = 0;
+}
+
+void device_cache_name(PaDeviceIndex device, char* name, u32 size) {
+  const PaDeviceInfo* info = Pa_GetDeviceInfo(device);
+  const PaHostApiInfo* host_api = Pa_GetHostApiInfo(info->hostApi);
+  snprintf(name, size, "%s/%s", host_api ? host_api->name : "?", info->name);
+  // tabs and newlines would break the cache file format
+  for (char* it = name; *it; ++it) {
+    if (*it == '\t' || *it == '\n') {
+      *it = ' ';
+    }
+  }
+}
+
+// Look the combination up in the cache and only fall back to the (slow) probe on a miss
+u8 device_is_format_supported(const PaStreamParameters* params, i32 sample_rate) {
+  char name[MAX_DEVICE_NAME_SIZE] = {0};
+  device_cache_name(params->device, name, MAX_DEVICE_NAME_SIZE);
+  for (u32 i = 0; i < device_cache.count; ++i) {
+    Device_cache_entry* entry = &device_cache.entries[i];
+    if (entry->sample_rate == sample_rate && entry->sample_format == params->sampleFormat && entry->channel_count == params->channelCount && strncmp(entry->name, name, MAX_DEVICE_NAME_SIZE) == 0) {
+      return entry->supported;
+    }
+  }
+  u8 supported = Pa_IsFormatSupported(NULL, params, sample_rate) == paFormatIsSupported;
+  if (device_cache.count < MAX_DEVICE_CACHE_ENTRIES) {
+    Device_cache_entry* entry = &device_cache.entries[device_cache.count++];
+    snprintf(entry->name, MAX_DEVICE_NAME_SIZE, "%s", name);
+    entry->sample_rate = sample_rate;
+    entry->sample_format = params->sampleFormat;
+    entry->channel_count = params->channelCount;
+    entry->supported = supported;
+    device_cache.dirty = 1;
+  }
+  return supported;
+}
+
+// Drop a cached result that turned out to be wrong, e.g. after the device changed
+void device_cache_forget(const PaStreamParameters* params, i32 sample_rate) {
+  char name[MAX_DEVICE_NAME_SIZE] = {0};
+  device_cache_name(params->device, name, MAX_DEVICE_NAME_SIZE);
+  for (u32 i = 0; i < device_cache.count; ++i) {
+    Device_cache_entry* entry = &device_cache.entries[i];
+    if (entry->sample_rate == sample_rate && entry->sample_format == params->sampleFormat && entry->channel_count == params->channelCount && strncmp(entry->name, name, MAX_DEVICE_NAME_SIZE) == 0) {
+      *entry = device_cache.entries[--device_cache.count];
+      device_cache.dirty = 1;
+      return;
+    }
+  }
+}
+
+PaDeviceIndex binplay_find_device(const char* device) {
+  PaDeviceIndex count = Pa_GetDeviceCount();
+  char* end = NULL;
+  long index = strtol(device, &end, 10);
+  if (end != device && *end == 0) {
+    if (index >= 0 && index < count && Pa_GetDeviceInfo(index)->maxOutputChannels > 0) {
+      return (PaDeviceIndex)index;
+    }
+    return paNoDevice;
+  }
+  for (PaDeviceIndex i = 0; i < count; ++i) {
+    const PaDeviceInfo* info = Pa_GetDeviceInfo(i);
+    if (info->maxOutputChannels > 0 && strstr(info->name, device)) {
+      return i;
+    }
+  }
+  return paNoDevice;
+}
+
+Result binplay_list_devices() {
+  const i32 sample_rates[] = { 22050, 44100, 48000, 88200, 96000, };
+  const PaSampleFormat sample_formats[] = { paInt16, paInt32, paFloat32, };
+  const char* sample_format_desc[] = { "int16", "int32", "float32", };
+
+  PaError err = Pa_Initialize();
+  if (err != paNoError) {
+    fprintf(stderr, "PortAudio Error: %s\n", Pa_GetErrorText(err));
+    return Error;
+  }
+  device_cache_load(&device_cache);
+
+  PaHostApiIndex host_api_count = Pa_GetHostApiCount();
+  PaDeviceIndex default_device = Pa_GetDefaultOutputDevice();
+  for (PaHostApiIndex api = 0; api < host_api_count; ++api) {
+    const PaHostApiInfo* host_api = Pa_GetHostApiInfo(api);
+    fprintf(stdout, "Host API %d: %s\n", api, host_api->name);
+    for (PaDeviceIndex device = 0; device < Pa_GetDeviceCount(); ++device) {
+      const PaDeviceInfo* info = Pa_GetDeviceInfo(device);
+      if (info->hostApi != api || info->maxOutputChannels <= 0) {
+        continue;
+      }
+      fprintf(stdout, "  [%d] %s%s (max channels: %d, default rate: %g, latency: %.1f - %.1f ms)\n",
+        device,
+        info->name,
+        device == default_device ? " (default)" : "",
+        info->maxOutputChannels,
+        info->defaultSampleRate,
+        1000 * info->defaultLowOutputLatency,
+        1000 * info->defaultHighOutputLatency
+      );
+      PaStreamParameters params = {0};
+      params.device = device;
+      params.suggestedLatency = info->defaultHighOutputLatency;
+      const i32 channel_counts[] = { 1, 2, info->maxOutputChannels, };
+      for (u32 c = 0; c < ARR_SIZE(channel_counts); ++c) {
+        if (c > 0 && channel_counts[c] <= channel_counts[c - 1]) {
+          continue;
+        }
+        params.channelCount = channel_counts[c];
+        for (u32 f = 0; f < ARR_SIZE(sample_formats); ++f) {
+          params.sampleFormat = sample_formats[f];
+          fprintf(stdout, "      %2d ch %-7s:", params.channelCount, sample_format_desc[f]);
+          for (u32 r = 0; r < ARR_SIZE(sample_rates); ++r) {
+            if (device_is_format_supported(&params, sample_rates[r])) {
+              fprintf(stdout, " %d", sample_rates[r]);
+            }
+          }
+          fprintf(stdout, "\n");
+        }
+      }
+    }
+  }
+  device_cache_save(&device_cache);
+  Pa_Terminate();
+  return NoError;
+}
+
+Result binplay_open_stream(Binplay* b) {
+  Result result = NoError;
+  PaError err = Pa_Initialize();
+  if (err != paNoError) {
+    Pa_Terminate();
+    fprintf(stderr, "PortAudio Error: %s\n", Pa_GetErrorText(err));
+    return_defer(Error);
+  }
+  device_cache_load(&device_cache);
+
+  PaDeviceIndex output_device = g_device ? binplay_find_device(g_device) : Pa_GetDefaultOutputDevice();
+  if (output_device == paNoDevice) {
+    fprintf(stderr, "No output device found%s%s\n", g_device ? " matching " : "", g_device ? g_device : "");
+    return_defer(Error);
+  }
+  output_port.device = output_device;
+  output_port.channelCount = g_channel_count;
+  output_port.sampleFormat = paInt16;
+  const PaDeviceInfo* device_info = Pa_GetDeviceInfo(output_port.device);
+  if (g_latency_ms > 0.0f) {
+    output_port.suggestedLatency = g_latency_ms / 1000.0;
+  }
+  else if (g_low_latency) {
+    output_port.suggestedLatency = device_info->defaultLowOutputLatency;
+  }
+  else {
+    output_port.suggestedLatency = device_info->defaultHighOutputLatency;
+  }
+  output_port.hostApiSpecificStreamInfo = NULL;
+
+  if (!device_is_format_supported(&output_port, g_sample_rate)) {
+    // The cached result may be stale, so probe once more before giving up
+    device_cache_forget(&output_port, g_sample_rate);
+    if (!device_is_format_supported(&output_port, g_sample_rate)) {
+      fprintf(stderr, "PortAudio Error: %s\n", Pa_GetErrorText(Pa_IsFormatSupported(NULL, &output_port, g_sample_rate)));
+      return_defer(Error);
+    }
+  }
+
+  err = Pa_OpenStream(
+    &stream,
+    NULL,
+    &output_port,
+    g_sample_rate,
+    g_frames_per_buffer > 0 ? g_frames_per_buffer : paFramesPerBufferUnspecified,
+    paNoFlag,
+    g_engine == EngineCallback ? stereo_callback : NULL,
+    NULL
+  );
+  if (err != paNoError) {
+    device_cache_forget(&output_port, g_sample_rate);
+    Pa_Terminate();
+    fprintf(stderr, "PortAudio Error: %s\n", Pa_GetErrorText(err));
+    return_defer(Error);
+  }
+defer:
+  device_cache_save(&device_cache);
+  return result;
+}
+
+Result binplay_start_stream(Binplay* b) {
+  PaError err = Pa_StartStream(stream);
+  if (err != paNoError) {
+    Pa_Terminate();
+    fprintf(stderr, "PortAudio Error: %s\n", Pa_GetErrorText(err));
+    return Error;
+  }
+  if (g_engine == EngineBlocking) {
+    if (pthread_create(&b->writer, NULL, binplay_writer_thread, b) != 0) {
+      fprintf(stderr, "Failed to start writer thread\n");
+      return Error;
+    }
+    b->writer_running = 1;
+  }
+  RT_STEADY_STATE_BEGIN();
+  return NoError;
+}
+
+f64 cpu_time_now(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+u64 clock_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+u32 profile_bucket(u64 ns) {
+  if (ns < PROFILE_SUB_BUCKETS) {
+    return ns;
+  }
+  u32 exponent = 63 - __builtin_clzll(ns);
+  if (exponent > PROFILE_MAX_EXPONENT) {
+    return PROFILE_BUCKETS - 1;
+  }
+  u32 sub = (ns >> (exponent - PROFILE_SUB_BITS)) & (PROFILE_SUB_BUCKETS - 1);
+  return (exponent - PROFILE_SUB_BITS + 1) * PROFILE_SUB_BUCKETS + sub;
+}
+
+// Upper bound (in ns) of the values that end up in the bucket
+u64 profile_bucket_value(u32 bucket) {
+  if (bucket < PROFILE_SUB_BUCKETS) {
+    return bucket;
+  }
+  u32 exponent = bucket / PROFILE_SUB_BUCKETS + PROFILE_SUB_BITS - 1;
+  u64 sub = bucket % PROFILE_SUB_BUCKETS;
+  u64 width = 1ull << (exponent - PROFILE_SUB_BITS);
+  return ((PROFILE_SUB_BUCKETS + sub) << (exponent - PROFILE_SUB_BITS)) + width - 1;
+}
+
+void profile_record(Profile* profile, u64 ns, u32 frames) {
+  atomic_fetch_add_explicit(&profile->buckets[profile_bucket(ns)], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&profile->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&profile->total_ns, ns, memory_order_relaxed);
+  atomic_fetch_add_explicit(&profile->frames, frames, memory_order_relaxed);
+  u64 max = atomic_load_explicit(&profile->max_ns, memory_order_relaxed);
+  while (ns > max && !atomic_compare_exchange_weak_explicit(&profile->max_ns, &max, ns, memory_order_relaxed, memory_order_relaxed));
+}
+
+u64 profile_percentile(Profile* profile, f64 q) {
+  u64 total = 0;
+  for (u32 i = 0; i < PROFILE_BUCKETS; ++i) {
+    total += atomic_load_explicit(&profile->buckets[i], memory_order_relaxed);
+  }
+  if (total == 0) {
+    return 0;
+  }
+  u64 target = (u64)(q * total);
+  if (target >= total) {
+    target = total - 1;
+  }
+  // Bucket bounds can overshoot the largest value actually seen
+  u64 max = atomic_load_explicit(&profile->max_ns, memory_order_relaxed);
+  u64 seen = 0;
+  for (u32 i = 0; i < PROFILE_BUCKETS; ++i) {
+    seen += atomic_load_explicit(&profile->buckets[i], memory_order_relaxed);
+    if (seen > target) {
+      u64 value = profile_bucket_value(i);
+      return value < max ? value : max;
+    }
+  }
+  return max;
+}
+
+Result profile_write_json(Profile* profile, const char* path) {
+  FILE* fp = fopen(path, "w");
+  if (!fp) {
+    fprintf(stderr, "Failed to open '%s' for writing\n", path);
+    return Error;
+  }
+  char host[64] = {0};
+  gethostname(host, sizeof(host) - 1);
+  u64 count = atomic_load_explicit(&profile->count, memory_order_relaxed);
+  u64 total_ns = atomic_load_explicit(&profile->total_ns, memory_order_relaxed);
+
+  fprintf(fp, "{\n");
+  fprintf(fp, "  \"build\": \"%s %s\",\n", __DATE__, __TIME__);
+  fprintf(fp, "  \"host\": \"%s\",\n", host);
+  fprintf(fp, "  \"engine\": \"%s\",\n", engine_desc[g_engine]);
+  fprintf(fp, "  \"sample_rate\": %d,\n", g_sample_rate);
+  fprintf(fp, "  \"channel_count\": %d,\n", g_channel_count);
+  fprintf(fp, "  \"frames_per_buffer\": %d,\n", g_frames_per_buffer);
+  fprintf(fp, "  \"count\": %llu,\n", (unsigned long long)count);
+  fprintf(fp, "  \"frames\": %llu,\n", (unsigned long long)atomic_load_explicit(&profile->frames, memory_order_relaxed));
+  fprintf(fp, "  \"mean_ns\": %llu,\n", (unsigned long long)(count ? total_ns / count : 0));
+  fprintf(fp, "  \"p50_ns\": %llu,\n", (unsigned long long)profile_percentile(profile, 0.5));
+  fprintf(fp, "  \"p99_ns\": %llu,\n", (unsigned long long)profile_percentile(profile, 0.99));
+  fprintf(fp, "  \"p999_ns\": %llu,\n", (unsigned long long)profile_percentile(profile, 0.999));
+  fprintf(fp, "  \"max_ns\": %llu,\n", (unsigned long long)atomic_load_explicit(&profile->max_ns, memory_order_relaxed));
+  fprintf(fp, "  \"buckets\": [");
+  u8 first = 1;
+  for (u32 i = 0; i < PROFILE_BUCKETS; ++i) {
+    u32 n = atomic_load_explicit(&profile->buckets[i], memory_order_relaxed);
+    if (n) {
+      fprintf(fp, "%s\n    [%llu, %u]", first ? "" : ",", (unsigned long long)profile_bucket_value(i), n);
+      first = 0;
+    }
+  }
+  fprintf(fp, "\n  ]\n}\n");
+  fclose(fp);
+  return NoError;
+}
+
+// Renders large blocks and pushes them with blocking writes. Each write is sized by what the
+// stream can take right now, but never below one buffer so we don't spin on tiny writes.
+void* binplay_writer_thread(void* userdata) {
+  Binplay* b = (Binplay*)userdata;
+  const u32 min_frames = binplay_buffer_frames() < WRITE_BLOCK_FRAMES ? binplay_buffer_frames() : WRITE_BLOCK_FRAMES;
+  if (g_realtime) {
+    rt_setup_audio_thread(b);
+  }
+  f64 wall_start = cpu_time_now(CLOCK_MONOTONIC);
+  f64 cpu_start = cpu_time_now(CLOCK_THREAD_CPUTIME_ID);
+
+  while (!atomic_load(&b->done)) {
+    long available = Pa_GetStreamWriteAvailable(stream);
+    if (available < 0) {
+      break;
+    }
+    u32 frames = available > min_frames ? (u32)available : min_frames;
+    if (frames > WRITE_BLOCK_FRAMES) {
+      frames = WRITE_BLOCK_FRAMES;
+    }
+    binplay_process_audio(b->write_buffer, frames);
+    PaError err = Pa_WriteStream(stream, b->write_buffer, frames);
+    if (err == paOutputUnderflowed) {
+      xrun_record(&b->xruns, XrunUnderflow, b->sources[0].cursor);
+      binplay_notify_ui(b);
+    }
+    else if (err != paNoError) {
+      break;
+    }
+
+    f64 wall = cpu_time_now(CLOCK_MONOTONIC);
+    if (wall - wall_start >= 1.0) {
+      f64 cpu = cpu_time_now(CLOCK_THREAD_CPUTIME_ID);
+      atomic_store_explicit(&b->engine_load, (cpu - cpu_start) / (wall - wall_start), memory_order_relaxed);
+      wall_start = wall;
+      cpu_start = cpu;
+    }
+  }
+  return NULL;
+}
+
+// Little and big endian fields of file headers
+#define READ_U16LE(P) ((u32)(P)[0] | (u32)(P)[1] << 8)
+#define READ_U32LE(P) (READ_U16LE(P) | READ_U16LE((P) + 2) << 16)
+#define READ_U64LE(P) ((u64)READ_U32LE(P) | (u64)READ_U32LE((P) + 4) << 32)
+#define READ_U16BE(P) ((u32)(P)[0] << 8 | (u32)(P)[1])
+#define READ_U32BE(P) (READ_U16BE(P) << 16 | READ_U16BE((P) + 2))
+
+// Finds out the format of a file from its header. The file is mapped and the header read in
+// place, chunks may be anywhere in it. Files without a known header are raw data.
+Result audio_header_parse(const char* path, i32 fd, i64 file_size, Audio_header* header) {
+  memset(header, 0, sizeof(*header));
+  header->data_end = file_size;
+  if (file_size < 12) {
+    return NoError;
+  }
+  const u8* data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Failed to map '%s'\n", path);
+    return Error;
+  }
+  Result result = NoError;
+  if ((memcmp(data, "RIFF", 4) == 0 || memcmp(data, "RF64", 4) == 0) && memcmp(&data[8], "WAVE", 4) == 0) {
+    result = wav_parse(path, data, file_size, header);
+  }
+  else if (memcmp(data, "FORM", 4) == 0 && (memcmp(&data[8], "AIFF", 4) == 0 || memcmp(&data[8], "AIFC", 4) == 0)) {
+    result = aiff_parse(path, data, file_size, header);
+  }
+  else if (memcmp(data, ".snd", 4) == 0) {
+    result = au_parse(path, data, file_size, header);
+  }
+  munmap((void*)data, file_size);
+  if (result == NoError && header->container && header->data_end <= header->data_start) {
+    fprintf(stderr, "'%s' has no sample data\n", path);
+    result = Error;
+  }
+  return result;
+}
+
+// RIFF/WAVE and its 64 bit variant RF64, where the sizes that don't fit are in the ds64 chunk
+Result wav_parse(const char* path, const u8* data, i64 size, Audio_header* header) {
+  const u8 rf64 = memcmp(data, "RF64", 4) == 0;
+  header->container = rf64 ? "rf64" : "wav";
+  i64 ds64_data_size = -1;
+  u8 has_format = 0;
+  i64 offset = 12;
+  while (offset + 8 <= size) {
+    const u8* chunk = &data[offset];
+    const u8* body = &chunk[8];
+    const i64 chunk_size = READ_U32LE(&chunk[4]);
+    const i64 available = size - offset - 8;
+    if (memcmp(chunk, "ds64", 4) == 0 && chunk_size >= 16 && available >= 16) {
+      ds64_data_size = READ_U64LE(&body[8]);
+    }
+    else if (memcmp(chunk, "fmt ", 4) == 0) {
+      if (chunk_size < 16 || available < 16) {
+        fprintf(stderr, "'%s' has a truncated fmt chunk\n", path);
+        return Error;
+      }
+      u32 tag = READ_U16LE(&body[0]);
+      const u32 channel_count = READ_U16LE(&body[2]);
+      const u32 block_align = READ_U16LE(&body[12]);
+      // WAVE_FORMAT_EXTENSIBLE, the actual format is the start of the sub format guid
+      if (tag == 0xfffe && chunk_size >= 40 && available >= 40) {
+        tag = READ_U16LE(&body[24]);
+      }
+      if (tag != 1 && tag != 3) {
+        fprintf(stderr, "'%s' uses wav format 0x%04x, only pcm and float samples are supported\n", path, tag);
+        return Error;
+      }
+      header->sample_rate = READ_U32LE(&body[4]);
+      header->channel_count = channel_count;
+      header->sample_size = channel_count ? block_align / channel_count : 0;
+      header->float_samples = tag == 3;
+      has_format = 1;
+    }
+    else if (memcmp(chunk, "data", 4) == 0) {
+      i64 data_size = rf64 && chunk_size == 0xffffffff && ds64_data_size >= 0 ? ds64_data_size : chunk_size;
+      header->data_start = offset + 8;
+      // Recorders that were cut off leave a size past the end of the file
+      header->data_end = data_size < available ? header->data_start + data_size : size;
+      if (has_format) {
+        return NoError;
+      }
+    }
+    // LIST (metadata) and anything unknown is skipped, chunks are padded to an even size
+    offset += 8 + chunk_size + (chunk_size & 1);
+  }
+  if (!has_format || !header->data_start) {
+    fprintf(stderr, "'%s' is missing its %s chunk\n", path, has_format ? "data" : "fmt");
+    return Error;
+  }
+  return NoError;
+}
+
+// AIFF and AIFC: big endian chunks, samples in the SSND chunk
+Result aiff_parse(const char* path, const u8* data, i64 size, Audio_header* header) {
+  const u8 aifc = memcmp(&data[8], "AIFC", 4) == 0;
+  header->container = aifc ? "aifc" : "aiff";
+  header->big_endian = 1;
+  header->signed_bytes = 1;
+  u8 has_format = 0;
+  i64 offset = 12;
+  while (offset + 8 <= size) {
+    const u8* chunk = &data[offset];
+    const u8* body = &chunk[8];
+    const i64 chunk_size = READ_U32BE(&chunk[4]);
+    const i64 available = size - offset - 8;
+    if (memcmp(chunk, "COMM", 4) == 0) {
+      if (chunk_size < 18 || available < (aifc ? 22 : 18)) {
+        fprintf(stderr, "'%s' has a truncated COMM chunk\n", path);
+        return Error;
+      }
+      header->channel_count = READ_U16BE(&body[0]);
+      header->sample_size = (READ_U16BE(&body[6]) + 7) / 8;
+      header->sample_rate = (i32)read_extended(&body[8]);
+      if (aifc) {
+        const u8* compression = &body[18];
+        if (memcmp(compression, "sowt", 4) == 0) {
+          header->big_endian = 0;
+        }
+        else if (memcmp(compression, "fl32", 4) == 0 || memcmp(compression, "FL32", 4) == 0) {
+          header->float_samples = 1;
+        }
+        else if (memcmp(compression, "NONE", 4) != 0 && memcmp(compression, "twos", 4) != 0) {
+          fprintf(stderr, "'%s' uses aifc compression '%.4s', only uncompressed samples are supported\n", path, compression);
+          return Error;
+        }
+      }
+      has_format = 1;
+    }
+    else if (memcmp(chunk, "SSND", 4) == 0 && chunk_size >= 8 && available >= 8) {
+      const i64 end = chunk_size < available ? offset + 8 + chunk_size : size;
+      header->data_start = offset + 16 + READ_U32BE(&body[0]);
+      header->data_end = end;
+    }
+    offset += 8 + chunk_size + (chunk_size & 1);
+  }
+  if (!has_format || !header->data_start) {
+    fprintf(stderr, "'%s' is missing its %s chunk\n", path, has_format ? "SSND" : "COMM");
+    return Error;
+  }
+  return NoError;
+}
+
+// Sun/NeXT audio: a fixed big endian header followed by the samples
+Result au_parse(const char* path, const u8* data, i64 size, Audio_header* header) {
+  if (size < 24) {
+    fprintf(stderr, "'%s' has a truncated au header\n", path);
+    return Error;
+  }
+  const i64 data_start = READ_U32BE(&data[4]);
+  const i64 data_size = READ_U32BE(&data[8]);
+  const u32 encoding = READ_U32BE(&data[12]);
+  header->container = "au";
+  header->big_endian = 1;
+  header->signed_bytes = 1;
+  header->sample_rate = READ_U32BE(&data[16]);
+  header->channel_count = READ_U32BE(&data[20]);
+  switch (encoding) {
+    case 2: header->sample_size = 1; break;
+    case 3: header->sample_size = 2; break;
+    case 5: header->sample_size = 4; break;
+    case 6: header->sample_size = 4; header->float_samples = 1; break;
+    default: {
+      fprintf(stderr, "'%s' uses au encoding %u, only 8, 16 and 32 bit linear and float samples are supported\n", path, encoding);
+      return Error;
+    }
+  }
+  header->data_start = data_start < size ? data_start : size;
+  // The size is allowed to be unknown (~0), the data then runs to the end of the file
+  header->data_end = data_size != 0xffffffff && data_start + data_size < size ? data_start + data_size : size;
+  return NoError;
+}
+
+// 80 bit IEEE 754 extended precision, the sample rate of AIFF files
+f64 read_extended(const u8* p) {
+  const i32 exponent = ((p[0] & 0x7f) << 8 | p[1]) - 16383 - 63;
+  const u64 mantissa = (u64)READ_U32BE(&p[2]) << 32 | READ_U32BE(&p[6]);
+  const f64 value = ldexp((f64)mantissa, exponent);
+  return p[0] & 0x80 ? -value : value;
+}
+
+// A sample size or channel count of 0 is taken from the header of the file. Raw data falls
+// back to the global format, which binplay_init() settles with the first source.
+Result source_open(Source* s, const char* path, i32 sample_size, i32 channel_count, f32 gain, i32 route) {
+  Result result = NoError;
+  if (route >= g_channel_count) {
+    fprintf(stderr, "Can't route '%s' to channel %d, there are only %d output channels\n", path, route, g_channel_count);
+    return Error;
+  }
+  if (source_open_file(s, path, sample_size, channel_count) != NoError) {
+    return_defer(Error);
+  }
+  s->route = route;
+  s->gain = gain;
+  source_seek(s, s->start_pos);
+defer:
+  return result;
+}
+
+// Playback buffers of the source, once the format of every source is known
+Result source_alloc(Source* s, Arena* arena) {
+  const u32 buffer_frames = binplay_buffer_frames();
+  s->ring = arena_push(arena, READ_AHEAD_SIZE);
+  s->scratch = arena_push(arena, buffer_frames * s->sample_size * s->channel_count);
+  s->samples = arena_push(arena, buffer_frames * s->channel_count * sizeof(f32));
+  if (!s->ring || !s->scratch || !s->samples) {
+    return Error;
+  }
+  return NoError;
+}
+
+// Opens the file and works out how its bytes are read, without any of the playback buffers
+Result source_open_file(Source* s, const char* path, i32 sample_size, i32 channel_count) {
+  Result result = NoError;
+  memset(s, 0, sizeof(*s));
+  s->fd = -1;
+  if ((s->fd = open(path, O_RDONLY)) < 0) {
+    fprintf(stderr, "Failed to open '%s'\n", path);
+    return_defer(Error);
+  }
+  struct stat st;
+  if (fstat(s->fd, &st) < 0) {
+    fprintf(stderr, "Failed to stat '%s'\n", path);
+    return_defer(Error);
+  }
+  Audio_header header;
+  if (audio_header_parse(path, s->fd, st.st_size, &header) != NoError) {
+    return_defer(Error);
+  }
+  if (!sample_size) {
+    sample_size = header.sample_size ? header.sample_size : (g_sample_size ? g_sample_size : SAMPLE_SIZE);
+  }
+  if (!channel_count) {
+    channel_count = header.channel_count ? header.channel_count : (g_channel_count ? g_channel_count : CHANNEL_COUNT);
+  }
+  if (sample_size != 1 && sample_size != 2 && sample_size != 4) {
+    fprintf(stderr, "Unsupported sample size %d for '%s', expected 1, 2 or 4\n", sample_size, path);
+    return_defer(Error);
+  }
+  if (channel_count <= 0) {
+    fprintf(stderr, "Invalid channel count %d for '%s'\n", channel_count, path);
+    return_defer(Error);
+  }
+  s->file_name = path;
+  s->file_size = header.data_end;
+  s->start_pos = header.data_start;
+  s->sample_rate = header.sample_rate;
+  s->container = header.container;
+  // The encoding only applies to the sample size of the header, an override reads plain pcm
+  if (sample_size == header.sample_size) {
+    s->big_endian = header.big_endian;
+    s->signed_bytes = header.signed_bytes;
+    s->float_samples = header.float_samples;
+  }
+  if (s->float_samples && sample_size != 4) {
+    fprintf(stderr, "Unsupported float sample size %d for '%s', expected 4\n", sample_size, path);
+    return_defer(Error);
+  }
+  if (s->file_size <= s->start_pos) {
+    fprintf(stderr, "'%s' has no sample data\n", path);
+    return_defer(Error);
+  }
+  s->sample_size = sample_size;
+  s->channel_count = channel_count;
+  s->route = -1;
+  s->gain = 1.0f;
+  s->region_start = s->start_pos;
+  s->region_end = s->file_size;
+defer:
+  if (result != NoError && s->fd >= 0) {
+    close(s->fd);
+    s->fd = -1;
+  }
+  return result;
+}
+
+// Parse a source given as path[:gain[:channel[:sample-size[:channel-count]]]], where a
+// negative channel maps the channels of the file one to one onto the output channels
+Result source_parse_spec(Source* s, char* spec) {
+  char* fields[5] = { spec, NULL, NULL, NULL, NULL, };
+  for (u32 i = 1; i < ARR_SIZE(fields); ++i) {
+    char* separator = strchr(fields[i - 1], ':');
+    if (!separator) {
+      break;
+    }
+    *separator = 0;
+    fields[i] = separator + 1;
+  }
+  f32 gain = fields[1] && *fields[1] ? strtof(fields[1], NULL) : 1.0f;
+  i32 route = fields[2] && *fields[2] ? atoi(fields[2]) : -1;
+  i32 sample_size = fields[3] && *fields[3] ? atoi(fields[3]) : 0;
+  i32 channel_count = fields[4] && *fields[4] ? atoi(fields[4]) : 0;
+  return source_open(s, fields[0], sample_size, channel_count, gain, route < 0 ? -1 : route);
+}
+
+void source_close(Source* s) {
+  if (s->fd >= 0) {
+    close(s->fd);
+  }
+  s->fd = -1;
+  // The buffers go with the arena
+  s->ring = NULL;
+  s->scratch = NULL;
+  s->samples = NULL;
+}
+
+// Called from the audio thread only. Hands the region to the reader without a seek.
+void source_publish_region(Source* s) {
+  atomic_store_explicit(&s->seek_region_start, s->region_start, memory_order_relaxed);
+  atomic_store_explicit(&s->seek_region_end, s->region_end, memory_order_relaxed);
+  atomic_fetch_add_explicit(&s->region_gen, 1, memory_order_release);
+}
+
+// Called from the audio thread only
+void source_seek(Source* s, i64 offset) {
+  s->cursor = offset;
+  s->prefix = NULL;
+  s->prefix_size = 0;
+  s->prefix_used = 0;
+  s->gen += 1;
+  atomic_store_explicit(&s->seek_region_start, s->region_start, memory_order_relaxed);
+  atomic_store_explicit(&s->seek_region_end, s->region_end, memory_order_relaxed);
+  atomic_store_explicit(&s->seek_target, offset, memory_order_relaxed);
+  atomic_store_explicit(&s->seek_gen, s->gen, memory_order_release);
+}
+
+// Seek to `offset` with the bytes from there already in memory: those are played first and the
+// reader is sent to the end of them, so the callback after a jump never waits on a read
+void source_seek_cached(Source* s, i64 offset, const u8* prefix, u32 prefix_size) {
+  s->cursor = offset;
+  s->prefix = prefix;
+  s->prefix_size = prefix_size;
+  s->prefix_used = 0;
+  s->gen += 1;
+  atomic_store_explicit(&s->seek_region_start, s->region_start, memory_order_relaxed);
+  atomic_store_explicit(&s->seek_region_end, s->region_end, memory_order_relaxed);
+  atomic_store_explicit(&s->seek_target, offset + prefix_size, memory_order_relaxed);
+  atomic_store_explicit(&s->seek_gen, s->gen, memory_order_release);
+}
+
+// File offset of `data_offset` bytes into the data, on a whole frame and inside the file
+i64 source_offset(const Source* s, i64 data_offset) {
+  const i64 frame_size = s->sample_size * s->channel_count;
+  const i64 size = s->file_size - s->start_pos;
+  i64 position = data_offset < 0 ? 0 : data_offset;
+  position = position >= size ? size : position - position % frame_size;
+  return s->start_pos + position;
+}
+
+// Narrow the source down to `length` bytes (0 for the rest) from `offset` into its data. Nothing
+// outside of the range is read afterwards. Called before the reader starts.
+Result source_set_range(Source* s, i64 offset, i64 length) {
+  const i64 start = source_offset(s, offset);
+  if (offset < 0 || start >= s->file_size) {
+    fprintf(stderr, "Offset %lld is past the end of the data of '%s'\n", (long long)offset, s->file_name);
+    return Error;
+  }
+  // Whole frames only, so that a loop over the range wraps onto the same sample and channel
+  const i64 frame_size = s->sample_size * s->channel_count;
+  if (length > 0 && length < frame_size) {
+    fprintf(stderr, "Length %lld is shorter than one frame (%lld bytes) of '%s'\n", (long long)length, (long long)frame_size, s->file_name);
+    return Error;
+  }
+  if (length > 0 && start + length < s->file_size) {
+    s->file_size = start + length;
+  }
+  s->file_size = start + ((s->file_size - start) / frame_size) * frame_size;
+  if (s->file_size <= start) {
+    fprintf(stderr, "Offset %lld leaves less than one frame of '%s'\n", (long long)offset, s->file_name);
+    return Error;
+  }
+  s->start_pos = start;
+  s->region_start = s->start_pos;
+  s->region_end = s->file_size;
+  source_seek(s, s->start_pos);
+  return NoError;
+}
+
+// Whether the ring holds data from the current cursor, i.e. the reader has answered the last seek
+u8 source_ready(Source* s) {
+  if (s->synced_gen == s->gen) {
+    return 1;
+  }
+  if (atomic_load_explicit(&s->fill_gen, memory_order_acquire) != s->gen) {
+    return 0;
+  }
+  // Skip whatever was read before the seek
+  atomic_store_explicit(&s->tail, atomic_load_explicit(&s->fill_head, memory_order_relaxed), memory_order_release);
+  s->synced_gen = s->gen;
+  return 1;
+}
+
+// Called from the reader thread only. Returns the number of bytes read.
+u32 source_fill(Source* s) {
+  u32 gen = atomic_load_explicit(&s->seek_gen, memory_order_acquire);
+  u32 head = atomic_load_explicit(&s->head, memory_order_relaxed);
+  u32 region_gen = atomic_load_explicit(&s->region_gen, memory_order_acquire);
+  if (gen != s->reader_gen) {
+    s->reader_gen = gen;
+    s->reader_region_gen = region_gen;
+    s->fill_pos = atomic_load_explicit(&s->seek_target, memory_order_relaxed);
+    s->fill_start = atomic_load_explicit(&s->seek_region_start, memory_order_relaxed);
+    s->fill_end = atomic_load_explicit(&s->seek_region_end, memory_order_relaxed);
+    if (s->fill_pos < s->fill_start || s->fill_pos >= s->fill_end) {
+      s->fill_pos = s->fill_start;
+    }
+    atomic_store_explicit(&s->fill_head, head, memory_order_relaxed);
+    atomic_store_explicit(&s->fill_gen, gen, memory_order_release);
+  }
+  else if (region_gen != s->reader_region_gen) {
+    // New bounds without a seek: the audio thread made sure nothing read so far is outside them
+    s->reader_region_gen = region_gen;
+    s->fill_start = atomic_load_explicit(&s->seek_region_start, memory_order_relaxed);
+    s->fill_end = atomic_load_explicit(&s->seek_region_end, memory_order_relaxed);
+  }
+  u32 tail = atomic_load_explicit(&s->tail, memory_order_acquire);
+  u32 used = head - tail;
+  if (used >= READ_AHEAD_SIZE - READ_BEHIND_SIZE) {
+    return 0;
+  }
+  u32 space = READ_AHEAD_SIZE - READ_BEHIND_SIZE - used;
+  u32 offset = head & (READ_AHEAD_SIZE - 1);
+  u32 size = READ_CHUNK_SIZE;
+  if (size > space) {
+    size = space;
+  }
+  if (size > READ_AHEAD_SIZE - offset) {
+    size = READ_AHEAD_SIZE - offset;
+  }
+  // The ring always continues from the start of the region after its end, the audio thread
+  // decides whether that data is played (looping) or skipped. Wrapping only right before the
+  // next read lets bounds that grew in the meantime carry on from the old end instead.
+  if (s->fill_pos >= s->fill_end) {
+    s->fill_pos = s->fill_start;
+  }
+  if (size > s->fill_end - s->fill_pos) {
+    size = s->fill_end - s->fill_pos;
+  }
+  ssize_t bytes_read = pread(s->fd, &s->ring[offset], size, s->fill_pos);
+  if (bytes_read <= 0) {
+    return 0;
+  }
+  s->fill_pos += bytes_read;
+  atomic_store_explicit(&s->head, head + bytes_read, memory_order_release);
+  return bytes_read;
+}
+
+// Decode up to `frames` frames from the ring and add them onto the bus.
+// Returns 1 if the source reached the end of the file without looping.
+u8 source_mix(Source* s, f32* bus, u32 frames, u8 loop) {
+  const u32 prefix_left = s->prefix_size - s->prefix_used;
+  // Checked even while a cue plays from memory, so stale bytes leave the ring as soon as
+  // the reader answered and it can fill in behind the cue
+  const u8 ready = source_ready(s);
+  if (prefix_left == 0 && !ready) {
+    atomic_fetch_add_explicit(&s->starved, 1, memory_order_relaxed);
+    return 0;
+  }
+  const u32 frame_size = s->sample_size * s->channel_count;
+  u8 ended = 0;
+
+  if (s->cursor >= s->region_end) {
+    if (!loop) {
+      return 1;
+    }
+    s->cursor = s->region_start;
+  }
+  u32 size = frames * frame_size;
+  if (!loop && size > s->region_end - s->cursor) {
+    size = s->region_end - s->cursor;
+    ended = 1;
+  }
+
+  // Cached bytes of a cue first, the ring for the rest
+  u32 consumed = prefix_left < size ? prefix_left : size;
+  if (consumed > 0) {
+    memcpy(s->scratch, &s->prefix[s->prefix_used], consumed);
+    s->prefix_used += consumed;
+  }
+  if (consumed < size) {
+    u32 wanted = size - consumed;
+    u32 taken = 0;
+    if (ready) {
+      u32 tail = atomic_load_explicit(&s->tail, memory_order_relaxed);
+      u32 available = atomic_load_explicit(&s->head, memory_order_acquire) - tail;
+      taken = wanted < available ? wanted : available;
+      if (taken < wanted || !ended) {
+        // Only a trailing partial frame at the end of the file is consumed without being played
+        taken = ((consumed + taken) / frame_size) * frame_size - consumed;
+      }
+      u32 offset = tail & (READ_AHEAD_SIZE - 1);
+      u32 first = READ_AHEAD_SIZE - offset;
+      if (first > taken) {
+        first = taken;
+      }
+      memcpy(&s->scratch[consumed], &s->ring[offset], first);
+      memcpy(&s->scratch[consumed + first], s->ring, taken - first);
+      atomic_store_explicit(&s->tail, tail + taken, memory_order_release);
+    }
+    if (taken < wanted) {
+      ended = 0;
+      atomic_fetch_add_explicit(&s->starved, 1, memory_order_relaxed);
+    }
+    consumed += taken;
+  }
+  u32 count = (consumed / frame_size) * s->channel_count;
+  s->cursor += consumed;
+  if (s->cursor >= s->region_end && loop) {
+    s->cursor = s->region_start + (s->cursor - s->region_end);
+  }
+
+  source_decode(s, s->scratch, count, s->samples);
+  source_route(s, s->samples, count / s->channel_count, bus, g_channel_count);
+  return ended;
+}
+
+// Turns `count` samples as stored in the file into floats, big endian data is swapped in place
+void source_decode(const Source* s, u8* data, u32 count, f32* samples) {
+  if (s->big_endian) {
+    source_swap_bytes(data, count, s->sample_size);
+  }
+  switch (s->sample_size) {
+    case 1: {
+      const u8* in = data;
+      if (s->signed_bytes) {
+        for (u32 i = 0; i < count; ++i) {
+          samples[i] = (i8)in[i] * (1.0f / 128.0f);
+        }
+        break;
+      }
+      for (u32 i = 0; i < count; ++i) {
+        samples[i] = (in[i] - 128) * (1.0f / 128.0f);
+      }
+      break;
+    }
+    case 2: {
+      const i16* in = (const i16*)data;
+      for (u32 i = 0; i < count; ++i) {
+        samples[i] = in[i] * (1.0f / 32768.0f);
+      }
+      break;
+    }
+    case 4: {
+      if (s->float_samples) {
+        memcpy(samples, data, count * sizeof(f32));
+        break;
+      }
+      const i32* in = (const i32*)data;
+      for (u32 i = 0; i < count; ++i) {
+        samples[i] = in[i] * (1.0f / 2147483648.0f);
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+// Adds decoded frames onto a bus of `bus_channels` interleaved channels
+void source_route(const Source* s, const f32* samples, u32 frames, f32* bus, i32 bus_channels) {
+  if (s->route < 0 && s->channel_count == bus_channels) {
+    mix_add(bus, samples, s->gain, frames * s->channel_count);
+  }
+  else if (s->route < 0) {
+    for (u32 frame = 0; frame < frames; ++frame) {
+      for (i32 channel = 0; channel < bus_channels; ++channel) {
+        bus[frame * bus_channels + channel] += s->gain * samples[frame * s->channel_count + channel % s->channel_count];
+      }
+    }
+  }
+  else {
+    const f32 gain = s->gain / s->channel_count;
+    for (u32 frame = 0; frame < frames; ++frame) {
+      f32 sum = 0.0f;
+      for (i32 channel = 0; channel < s->channel_count; ++channel) {
+        sum += samples[frame * s->channel_count + channel];
+      }
+      bus[frame * bus_channels + s->route] += gain * sum;
+    }
+  }
+}
+
+void mix_add(f32* restrict bus, const f32* restrict samples, f32 gain, u32 count) {
+  u32 i = 0;
+  for (; i + 8 <= count; i += 8) {
+    v8f a, x;
+    memcpy(&a, &bus[i], sizeof(a));
+    memcpy(&x, &samples[i], sizeof(x));
+    a += x * gain;
+    memcpy(&bus[i], &a, sizeof(a));
+  }
+  for (; i < count; ++i) {
+    bus[i] += gain * samples[i];
+  }
+}
+
+// Keeps the read-ahead rings of all sources filled, round robin so that dozens of sources
+// each get their share of the disk
+void* binplay_reader_thread(void* userdata) {
+  Binplay* b = (Binplay*)userdata;
+  if (g_realtime) {
+    atomic_store(&b->rt_reader, rt_promote_thread(RT_PRIORITY_READER));
+  }
+  const struct timespec idle = { .tv_sec = READER_IDLE_NS / 1000000000LL, .tv_nsec = READER_IDLE_NS % 1000000000LL, };
+  while (!atomic_load(&b->done)) {
+    // Taken before the pass, so that anything the audio thread does during it wakes us again
+    const u32 wake = atomic_load(&b->wake_gen);
+    u32 bytes_read = 0;
+    for (u32 i = 0; i < b->source_count; ++i) {
+      bytes_read += source_fill(&b->sources[i]);
+    }
+    if (atomic_exchange_explicit(&b->ui_dirty, 0, memory_order_acquire)) {
+      eventfd_write(b->event_fd, 1);
+    }
+    if (bytes_read == 0) {
+      // Rings full, paused or at the end: sleep until the audio thread consumed, seeked or has news
+      binplay_wait_workers(b, wake, &idle);
+    }
+  }
+  return NULL;
+}
+
+Rt_status rt_promote_thread(i32 priority) {
+  struct sched_param param = { .sched_priority = priority };
+  if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0) {
+    return RtFifo;
+  }
+  // No CAP_SYS_NICE or rtprio limit, so settle for the best nice value we are allowed.
+  // On Linux this only applies to the calling thread.
+  if (setpriority(PRIO_PROCESS, 0, -10) == 0) {
+    return RtNice;
+  }
+  return RtDenied;
+}
+
+// Touch every page so that the first real use doesn't fault
+void rt_prefault(void* p, size_t size) {
+  if (p) {
+    memset(p, 0, size);
+  }
+}
+
+void rt_prefault_stack() {
+  volatile u8 stack[PREFAULT_STACK_SIZE];
+  for (u32 i = 0; i < PREFAULT_STACK_SIZE; i += 4096) {
+    stack[i] = 0;
+  }
+  (void)stack[0];
+}
+
+// Runs once on the audio thread, before it first enters the audio path
+void rt_setup_audio_thread(Binplay* b) {
+  atomic_store(&b->rt_audio, rt_promote_thread(RT_PRIORITY_AUDIO));
+  rt_prefault_stack();
+  b->audio_thread_ready = 1;
+}
+
+void rt_lock_memory(Binplay* b) {
+  // The session buffers were faulted in with the arena, this keeps them (and the stacks) there.
+  // Fails without CAP_IPC_LOCK or a large enough RLIMIT_MEMLOCK, we just keep going unlocked then
+  b->memory_locked = mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+}
+
+// Upper bound of what binplay_init() and the ui carve out of the arena, once the sources are
+// open. Cues and prefetch slots are counted at their full size.
+u64 binplay_arena_size(const Binplay* b) {
+  const u32 buffer_frames = binplay_buffer_frames();
+  u64 size = arena_aligned(buffer_frames * g_channel_count * sizeof(f32));
+  if (g_engine == EngineBlocking) {
+    size += arena_aligned(WRITE_BLOCK_FRAMES * g_channel_count * sizeof(i16));
+  }
+  for (u32 i = 0; i < b->source_count; ++i) {
+    const Source* s = &b->sources[i];
+    size += arena_aligned(READ_AHEAD_SIZE);
+    size += arena_aligned(buffer_frames * s->sample_size * s->channel_count);
+    size += arena_aligned(buffer_frames * s->channel_count * sizeof(f32));
+    size += PREFETCH_SLOTS * arena_aligned(prefetch_window_size(s));
+    size += MAX_CUES * arena_aligned(cue_prefetch_size(s));
+  }
+  const Source* primary = &b->sources[0];
+  const i64 block_count = (primary->file_size - primary->start_pos + INDEX_BLOCK_SIZE - 1) / INDEX_BLOCK_SIZE;
+  size += arena_aligned(block_count * sizeof(u32));
+  size += MAX_INDEX_WORKERS * arena_aligned(INDEX_BLOCK_SIZE);
+  size += arena_aligned(WAVEFORM_SCAN_CHUNK);
+  size += arena_aligned(SPECTRUM_FFT_SIZE * sizeof(f32));
+  size += arena_aligned(fft_memory_size(SPECTRUM_FFT_SIZE));
+  return size;
+}
+
+Result arena_init(Arena* arena, u64 size, Huge_pages huge_pages) {
+  memset(arena, 0, sizeof(*arena));
+  if (huge_pages != HugePagesOff) {
+    size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+  }
+  u8* base = MAP_FAILED;
+  if (huge_pages == HugePagesExplicit) {
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    if (base == MAP_FAILED) {
+      fprintf(stderr, "No huge pages reserved for %llu MB of buffers, trying transparent huge pages\n", (unsigned long long)(size >> 20));
+      huge_pages = HugePagesTransparent;
+    }
+  }
+  if (base == MAP_FAILED) {
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+      fprintf(stderr, "Failed to map %llu bytes for the session buffers\n", (unsigned long long)size);
+      return Error;
+    }
+    if (huge_pages == HugePagesTransparent && madvise(base, size, MADV_HUGEPAGE) != 0) {
+      huge_pages = HugePagesOff;
+    }
+    // Faulted in after the advice, so that the faults already take huge pages
+    rt_prefault(base, size);
+  }
+  arena->base = base;
+  arena->size = size;
+  arena->huge_pages = huge_pages;
+  return NoError;
+}
+
+// Zeroed, ARENA_ALIGN aligned memory, NULL once the arena is used up
+void* arena_push(Arena* arena, u64 size) {
+  const u64 aligned = arena_aligned(size);
+  if (!arena->base || aligned > arena->size - arena->used) {
+    return NULL;
+  }
+  void* p = arena->base + arena->used;
+  arena->used += aligned;
+  return p;
+}
+
+u64 arena_aligned(u64 size) {
+  return (size + ARENA_ALIGN - 1) & ~(u64)(ARENA_ALIGN - 1);
+}
+
+// Called once nothing uses the buffers any more
+void arena_free(Arena* arena) {
+  if (arena->base) {
+    munmap(arena->base, arena->size);
+  }
+  memset(arena, 0, sizeof(*arena));
+}
+
+// Bins of all levels live in one array, level n starts after the (halving) levels before it
+u32 waveform_level_offset(u32 level) {
+  return 2 * WAVEFORM_BASE_BINS - 2 * (WAVEFORM_BASE_BINS >> level);
+}
+
+// Coarsest level that still has a bin for every dot column of the panel
+u32 waveform_visible_level() {
+  const u32 dots = 2 * WAVEFORM_COLUMNS;
+  for (u32 level = WAVEFORM_LEVELS - 1; level > 0; --level) {
+    if ((WAVEFORM_BASE_BINS >> level) >= dots) {
+      return level;
+    }
+  }
+  return 0;
+}
+
+// Min and max over all channels, scaled to 16 bit samples
+// Swaps big endian samples in place into the byte order of the machine
+void source_swap_bytes(u8* data, u32 count, i32 sample_size) {
+  if (sample_size == 2) {
+    u16* samples = (u16*)data;
+    for (u32 i = 0; i < count; ++i) {
+      samples[i] = __builtin_bswap16(samples[i]);
+    }
+  }
+  else if (sample_size == 4) {
+    u32* samples = (u32*)data;
+    for (u32 i = 0; i < count; ++i) {
+      samples[i] = __builtin_bswap32(samples[i]);
+    }
+  }
+}
+
+void waveform_min_max(const Source* s, u8* data, u32 size, i16* min, i16* max) {
+  i32 lo = *min;
+  i32 hi = *max;
+  if (s->big_endian) {
+    source_swap_bytes(data, size / s->sample_size, s->sample_size);
+  }
+  switch (s->sample_size) {
+    case 1: {
+      for (u32 i = 0; i < size; ++i) {
+        i32 v = s->signed_bytes ? (i8)data[i] * 256 : (data[i] - 128) * 256;
+        lo = v < lo ? v : lo;
+        hi = v > hi ? v : hi;
+      }
+      break;
+    }
+    case 2: {
+      const i16* samples = (const i16*)data;
+      for (u32 i = 0; i < size / 2; ++i) {
+        i32 v = samples[i];
+        lo = v < lo ? v : lo;
+        hi = v > hi ? v : hi;
+      }
+      break;
+    }
+    case 4: {
+      const i32* samples = (const i32*)data;
+      const f32* floats = (const f32*)data;
+      for (u32 i = 0; i < size / 4; ++i) {
+        i32 v = s->float_samples ? (i32)(CLAMP(floats[i], -1.0f, 1.0f) * 32767.0f) : samples[i] >> 16;
+        lo = v < lo ? v : lo;
+        hi = v > hi ? v : hi;
+      }
+      break;
+    }
+    default:
+      break;
+  }
+  *min = lo;
+  *max = hi;
+}
+
+void waveform_store(Waveform* w, u32 index, i16 min, i16 max, Bin_state state) {
+  atomic_store_explicit(&w->bins[index], (u32)(u16)min | ((u32)(u16)max << 16), memory_order_relaxed);
+  atomic_store_explicit(&w->state[index], state, memory_order_release);
+}
+
+void* waveform_thread(void* userdata) {
+  Binplay* b = (Binplay*)userdata;
+  Waveform* w = &b->waveform;
+  Source* s = &b->sources[0];
+  const i64 data_size = s->file_size - s->start_pos;
+  u8* buffer = w->buffer;
+  if (!buffer) {
+    return NULL;
+  }
+
+  // Rough overview first: one small probe in the middle of every bin on screen
+  const u32 level = waveform_visible_level();
+  const u32 level_bins = WAVEFORM_BASE_BINS >> level;
+  for (u32 i = 0; i < level_bins && !atomic_load(&b->done); ++i) {
+    i64 offset = s->start_pos + (data_size * (2 * i + 1)) / (2 * level_bins);
+    offset -= (offset - s->start_pos) % s->sample_size;
+    i64 size = s->file_size - offset < WAVEFORM_PROBE_SIZE ? s->file_size - offset : WAVEFORM_PROBE_SIZE;
+    ssize_t bytes_read = size > 0 ? pread(s->fd, buffer, size, offset) : 0;
+    i16 min = INT16_MAX;
+    i16 max = INT16_MIN;
+    if (bytes_read > 0) {
+      waveform_min_max(s, buffer, bytes_read, &min, &max);
+    }
+    if (min <= max) {
+      waveform_store(w, waveform_level_offset(level) + i, min, max, BinEstimate);
+    }
+  }
+  atomic_fetch_add_explicit(&w->revision, 1, memory_order_release);
+  eventfd_write(b->event_fd, 1);
+
+  // Then the exact scan, bin by bin, merging every completed group of bins into its parent
+  f64 last_notify = cpu_time_now(CLOCK_MONOTONIC);
+  for (u32 i = 0; i < WAVEFORM_BASE_BINS && !atomic_load(&b->done); ++i) {
+    i64 begin = (data_size * i) / WAVEFORM_BASE_BINS;
+    i64 end = (data_size * (i + 1)) / WAVEFORM_BASE_BINS;
+    begin -= begin % s->sample_size;
+    end -= end % s->sample_size;
+    i16 min = INT16_MAX;
+    i16 max = INT16_MIN;
+    for (i64 offset = begin; offset < end && !atomic_load(&b->done);) {
+      u32 size = end - offset < WAVEFORM_SCAN_CHUNK ? end - offset : WAVEFORM_SCAN_CHUNK;
+      ssize_t bytes_read = pread(s->fd, buffer, size, s->start_pos + offset);
+      if (bytes_read <= 0) {
+        break;
+      }
+      waveform_min_max(s, buffer, bytes_read, &min, &max);
+      offset += bytes_read;
+    }
+    if (min > max) {
+      min = max = 0; // bin without any data, e.g. files with fewer samples than bins
+    }
+    waveform_store(w, i, min, max, BinExact);
+    for (u32 parent_level = 1; parent_level < WAVEFORM_LEVELS; ++parent_level) {
+      if ((i + 1) % (1u << parent_level) != 0) {
+        break;
+      }
+      u32 parent = i >> parent_level;
+      u32 child = waveform_level_offset(parent_level - 1) + 2 * parent;
+      u32 a = atomic_load_explicit(&w->bins[child], memory_order_relaxed);
+      u32 c = atomic_load_explicit(&w->bins[child + 1], memory_order_relaxed);
+      i16 a_min = (i16)(a & 0xffff), a_max = (i16)(a >> 16);
+      i16 c_min = (i16)(c & 0xffff), c_max = (i16)(c >> 16);
+      waveform_store(w, waveform_level_offset(parent_level) + parent, a_min < c_min ? a_min : c_min, a_max > c_max ? a_max : c_max, BinExact);
+    }
+    atomic_store_explicit(&w->bins_scanned, i + 1, memory_order_relaxed);
+    f64 now = cpu_time_now(CLOCK_MONOTONIC);
+    if (now - last_notify >= 0.25 || i + 1 == WAVEFORM_BASE_BINS) {
+      atomic_fetch_add_explicit(&w->revision, 1, memory_order_release);
+      last_notify = now;
+    }
+  }
+  return NULL;
+}
+
+// Draw the overview into the waveform text. Returns 1 if the text changed.
+u8 waveform_render(Binplay* b) {
+  Waveform* w = &b->waveform;
+  Source* s = &b->sources[0];
+  const i64 data_size = s->file_size - s->start_pos;
+  i32 column = (i32)(((binplay_cursor(b) - s->start_pos) * WAVEFORM_COLUMNS) / (data_size > 0 ? data_size : 1));
+  column = CLAMP(column, 0, WAVEFORM_COLUMNS - 1);
+  u32 revision = atomic_load_explicit(&w->revision, memory_order_acquire);
+  if (w->rendered && w->rendered_revision == revision && w->rendered_column == column) {
+    return 0;
+  }
+  w->rendered = 1;
+  w->rendered_revision = revision;
+  w->rendered_column = column;
+
+  // Braille dot bits, indexed by [dot row][dot column] within a cell
+  static const u8 dot_bits[4][2] = {
+    { 0x01, 0x08 },
+    { 0x02, 0x10 },
+    { 0x04, 0x20 },
+    { 0x40, 0x80 },
+  };
+  const u32 dots = 2 * WAVEFORM_COLUMNS;
+  const u32 dot_rows = 4 * WAVEFORM_ROWS;
+  const u32 level = waveform_visible_level();
+  const u32 level_bins = WAVEFORM_BASE_BINS >> level;
+  const u32 offset = waveform_level_offset(level);
+  u8 cells[WAVEFORM_ROWS][WAVEFORM_COLUMNS] = {0};
+
+  for (u32 x = 0; x < dots; ++x) {
+    i32 min = INT16_MAX;
+    i32 max = INT16_MIN;
+    for (u32 bin = (x * level_bins) / dots; bin < ((x + 1) * level_bins) / dots; ++bin) {
+      if (atomic_load_explicit(&w->state[offset + bin], memory_order_acquire) == BinEmpty) {
+        continue;
+      }
+      u32 value = atomic_load_explicit(&w->bins[offset + bin], memory_order_relaxed);
+      i32 bin_min = (i16)(value & 0xffff);
+      i32 bin_max = (i16)(value >> 16);
+      min = bin_min < min ? bin_min : min;
+      max = bin_max > max ? bin_max : max;
+    }
+    if (min > max) {
+      continue;
+    }
+    u32 top = ((32767 - max) * (dot_rows - 1)) / 65535;
+    u32 bottom = ((32767 - min) * (dot_rows - 1)) / 65535;
+    for (u32 y = top; y <= bottom; ++y) {
+      cells[y / 4][x / 2] |= dot_bits[y % 4][x % 2];
+    }
+  }
+
+  char* it = &w->text[0];
+  char* end = &w->text[WAVEFORM_TEXT_SIZE];
+  u32 scanned = atomic_load_explicit(&w->bins_scanned, memory_order_relaxed);
+  it += snprintf(it, end - it, "Waveform (%u%% scanned)\n", (100 * scanned) / WAVEFORM_BASE_BINS);
+  for (u32 row = 0; row < WAVEFORM_ROWS; ++row) {
+    for (u32 col = 0; col < WAVEFORM_COLUMNS; ++col) {
+      // U+2800 + dot bits, as utf-8
+      u32 codepoint = 0x2800 + cells[row][col];
+      *it++ = 0xe0 | (codepoint >> 12);
+      *it++ = 0x80 | ((codepoint >> 6) & 0x3f);
+      *it++ = 0x80 | (codepoint & 0x3f);
+    }
+    *it++ = '\n';
+  }
+  for (i32 col = 0; col < WAVEFORM_COLUMNS; ++col) {
+    *it++ = col == column ? '^' : ' ';
+  }
+  *it++ = '\n';
+  *it = 0;
+  return 1;
+}
+
+// Called from the audio thread: push a mono mix of the output, dropping what doesn't fit
+void spectrogram_tap(Spectrogram* sg, const f32* bus, u32 frames, f32 volume) {
+  u32 head = atomic_load_explicit(&sg->head, memory_order_relaxed);
+  u32 tail = atomic_load_explicit(&sg->tail, memory_order_acquire);
+  u32 space = SPECTRUM_RING_SIZE - (head - tail);
+  if (frames > space) {
+    atomic_fetch_add_explicit(&sg->dropped, frames - space, memory_order_relaxed);
+    frames = space;
+  }
+  const f32 scale = volume / g_channel_count;
+  for (u32 frame = 0; frame < frames; ++frame) {
+    f32 sum = 0.0f;
+    for (i32 channel = 0; channel < g_channel_count; ++channel) {
+      sum += bus[frame * g_channel_count + channel];
+    }
+    sg->ring[(head + frame) & (SPECTRUM_RING_SIZE - 1)] = scale * sum;
+  }
+  atomic_store_explicit(&sg->head, head + frames, memory_order_release);
+}
+
+// Bytes fft_init() lays the buffers and tables of a transform of `size` out in
+u64 fft_memory_size(u32 size) {
+  const u64 half = size / 2;
+  return (2 * (u64)size + 2 * (half + 1) + 2 * half + 2 * (half / 2 + 1)) * sizeof(f32) + half * sizeof(u32);
+}
+
+// `memory` holds fft_memory_size(size) bytes and belongs to the caller
+void fft_init(Fft* fft, u32 size, void* memory) {
+  const u32 half = size / 2;
+  u32 bits = 0;
+  while ((1u << bits) < half) {
+    bits += 1;
+  }
+  f32* p = memory;
+  fft->size = size;
+  fft->input = p;
+  fft->window = p + size;
+  fft->re = p + 2 * size;
+  fft->im = fft->re + half + 1;
+  fft->twiddle_re = fft->im + half + 1;
+  fft->twiddle_im = fft->twiddle_re + half;
+  fft->split_re = fft->twiddle_im + half;
+  fft->split_im = fft->split_re + half / 2 + 1;
+  fft->bit_reverse = (u32*)(fft->split_im + half / 2 + 1);
+  for (u32 stage = 1; stage < half; stage *= 2) {
+    for (u32 k = 0; k < stage; ++k) {
+      fft->twiddle_re[stage - 1 + k] = cosf(M_PI * k / stage);
+      fft->twiddle_im[stage - 1 + k] = -sinf(M_PI * k / stage);
+    }
+  }
+  for (u32 k = 0; k <= half / 2; ++k) {
+    fft->split_re[k] = cosf(2.0f * M_PI * k / size);
+    fft->split_im[k] = -sinf(2.0f * M_PI * k / size);
+  }
+  for (u32 i = 0; i < half; ++i) {
+    u32 reversed = 0;
+    for (u32 bit = 0; bit < bits; ++bit) {
+      reversed |= ((i >> bit) & 1) << (bits - 1 - bit);
+    }
+    fft->bit_reverse[i] = reversed;
+  }
+  for (u32 i = 0; i < size; ++i) {
+    // Hann window
+    fft->window[i] = 0.5f - 0.5f * cosf(2.0f * M_PI * i / (size - 1));
+  }
+}
+
+// Forward transform of `input` into the bins re/im[0 .. size / 2]
+void fft_forward(Fft* fft) {
+  const u32 n = fft->size / 2;
+  f32* restrict re = fft->re;
+  f32* restrict im = fft->im;
+  const f32* restrict input = fft->input;
+  // Even samples are the real parts and odd samples the imaginary parts, stored bit reversed
+  for (u32 i = 0; i < n; ++i) {
+    const u32 j = fft->bit_reverse[i];
+    re[j] = input[2 * i];
+    im[j] = input[2 * i + 1];
+  }
+  for (u32 half = 1; half < n; half *= 2) {
+    const f32* restrict w_re = &fft->twiddle_re[half - 1];
+    const f32* restrict w_im = &fft->twiddle_im[half - 1];
+    for (u32 start = 0; start < n; start += 2 * half) {
+      f32* restrict a_re = &re[start];
+      f32* restrict a_im = &im[start];
+      f32* restrict b_re = &re[start + half];
+      f32* restrict b_im = &im[start + half];
+      u32 k = 0;
+      for (; k + 8 <= half; k += 8) {
+        v8f ar, ai, br, bi, wr, wi;
+        memcpy(&ar, &a_re[k], sizeof(ar));
+        memcpy(&ai, &a_im[k], sizeof(ai));
+        memcpy(&br, &b_re[k], sizeof(br));
+        memcpy(&bi, &b_im[k], sizeof(bi));
+        memcpy(&wr, &w_re[k], sizeof(wr));
+        memcpy(&wi, &w_im[k], sizeof(wi));
+        const v8f tr = br * wr - bi * wi;
+        const v8f ti = br * wi + bi * wr;
+        br = ar - tr;
+        bi = ai - ti;
+        ar += tr;
+        ai += ti;
+        memcpy(&a_re[k], &ar, sizeof(ar));
+        memcpy(&a_im[k], &ai, sizeof(ai));
+        memcpy(&b_re[k], &br, sizeof(br));
+        memcpy(&b_im[k], &bi, sizeof(bi));
+      }
+      // The first three stages have fewer butterflies than a vector holds
+      for (; k < half; ++k) {
+        const f32 tr = b_re[k] * w_re[k] - b_im[k] * w_im[k];
+        const f32 ti = b_re[k] * w_im[k] + b_im[k] * w_re[k];
+        b_re[k] = a_re[k] - tr;
+        b_im[k] = a_im[k] - ti;
+        a_re[k] += tr;
+        a_im[k] += ti;
+      }
+    }
+  }
+  // Split: bins k and n - k of the real input both come from bins k and n - k of the packed
+  // transform, the even part plus the twiddled odd part
+  const f32 dc_re = re[0];
+  const f32 dc_im = im[0];
+  re[0] = dc_re + dc_im;
+  im[0] = 0.0f;
+  re[n] = dc_re - dc_im;
+  im[n] = 0.0f;
+  for (u32 k = 1; k <= n / 2; ++k) {
+    const u32 j = n - k;
+    const f32 even_re = 0.5f * (re[k] + re[j]);
+    const f32 even_im = 0.5f * (im[k] - im[j]);
+    const f32 odd_re = 0.5f * (im[k] + im[j]);
+    const f32 odd_im = -0.5f * (re[k] - re[j]);
+    const f32 c = fft->split_re[k];
+    const f32 s = fft->split_im[k];
+    re[k] = even_re + c * odd_re - s * odd_im;
+    im[k] = even_im + c * odd_im + s * odd_re;
+    re[j] = even_re - c * odd_re + s * odd_im;
+    im[j] = -even_im + c * odd_im + s * odd_re;
+  }
+}
+
+void* spectrogram_thread(void* userdata) {
+  Binplay* b = (Binplay*)userdata;
+  Spectrogram* sg = &b->spectrogram;
+  Fft fft = {0};
+  f32* window = sg->window;
+  if (!window || !sg->fft_memory) {
+    return NULL;
+  }
+  fft_init(&fft, SPECTRUM_FFT_SIZE, sg->fft_memory);
+
+  // Log spaced bands from SPECTRUM_MIN_FREQ up to nyquist, one per row
+  u32 band_start[SPECTROGRAM_ROWS + 1];
+  const f32 nyquist = g_sample_rate / 2.0f;
+  for (u32 row = 0; row <= SPECTROGRAM_ROWS; ++row) {
+    f32 freq = SPECTRUM_MIN_FREQ * powf(nyquist / SPECTRUM_MIN_FREQ, (f32)row / SPECTROGRAM_ROWS);
+    u32 bin = (u32)(freq / nyquist * (SPECTRUM_FFT_SIZE / 2));
+    band_start[row] = CLAMP(bin, 1, SPECTRUM_FFT_SIZE / 2);
+  }
+  for (u32 row = 1; row <= SPECTROGRAM_ROWS; ++row) {
+    if (band_start[row] <= band_start[row - 1]) {
+      band_start[row] = band_start[row - 1] + 1;
+    }
+  }
+
+  f32 column[SPECTROGRAM_ROWS];
+  for (u32 row = 0; row < SPECTROGRAM_ROWS; ++row) {
+    column[row] = SPECTRUM_FLOOR_DB;
+  }
+  u8 have_column = 0;
+  const f64 frame_time = 1.0 / g_spectrogram_fps;
+  f64 next_frame = cpu_time_now(CLOCK_MONOTONIC) + frame_time;
+  const u32 hop = g_fft_hop;
+  // Full scale sine with a hann window peaks at a quarter of the fft size
+  const f32 reference = SPECTRUM_FFT_SIZE / 4.0f;
+  u32 last_head = atomic_load_explicit(&sg->head, memory_order_relaxed);
+
+  while (!atomic_load(&b->done)) {
+    u32 tail = atomic_load_explicit(&sg->tail, memory_order_relaxed);
+    u32 head = atomic_load_explicit(&sg->head, memory_order_acquire);
+    if (head - tail >= hop) {
+      memmove(window, &window[hop], (SPECTRUM_FFT_SIZE - hop) * sizeof(f32));
+      for (u32 i = 0; i < hop; ++i) {
+        window[SPECTRUM_FFT_SIZE - hop + i] = sg->ring[(tail + i) & (SPECTRUM_RING_SIZE - 1)];
+      }
+      atomic_store_explicit(&sg->tail, tail + hop, memory_order_release);
+
+      for (u32 i = 0; i < SPECTRUM_FFT_SIZE; ++i) {
+        fft.input[i] = window[i] * fft.window[i];
+      }
+      fft_forward(&fft);
+      for (u32 row = 0; row < SPECTROGRAM_ROWS; ++row) {
+        f32 peak = 0.0f;
+        for (u32 bin = band_start[row]; bin < band_start[row + 1]; ++bin) {
+          f32 power = fft.re[bin] * fft.re[bin] + fft.im[bin] * fft.im[bin];
+          peak = power > peak ? power : peak;
+        }
+        f32 db = 10.0f * log10f(peak / (reference * reference) + 1e-12f);
+        column[row] = db > column[row] ? db : column[row];
+      }
+      have_column = 1;
+    }
+
+    f64 now = cpu_time_now(CLOCK_MONOTONIC);
+    if (now >= next_frame) {
+      next_frame += frame_time;
+      if (next_frame < now) {
+        next_frame = now + frame_time;
+      }
+      if (have_column) {
+        u32 index = atomic_load_explicit(&sg->columns, memory_order_relaxed);
+        for (u32 row = 0; row < SPECTROGRAM_ROWS; ++row) {
+          f32 level = (column[row] - SPECTRUM_FLOOR_DB) / -SPECTRUM_FLOOR_DB;
+          level = CLAMP(level, 0.0f, 1.0f);
+          atomic_store_explicit(&sg->history[index % SPECTROGRAM_COLUMNS][row], (u8)(level * 255), memory_order_relaxed);
+          column[row] = SPECTRUM_FLOOR_DB;
+        }
+        atomic_store_explicit(&sg->columns, index + 1, memory_order_release);
+        have_column = 0;
+        eventfd_write(b->event_fd, 1);
+      }
+    }
+    if (head == last_head && head - tail < hop && !have_column) {
+      // Nothing was tapped since the last pass (paused or stopped): wait for the next frame
+      // instead of polling, so that the idle player doesn't keep waking up
+      f64 idle = next_frame - cpu_time_now(CLOCK_MONOTONIC);
+      idle = CLAMP(idle, 0.001, SPECTRUM_IDLE_SLEEP);
+      usleep((u32)(idle * 1e6));
+    }
+    else if (head - tail < 2 * hop) {
+      usleep(1000);
+    }
+    last_head = head;
+  }
+  return NULL;
+}
+
+// Draw the history, newest column on the right. Returns 1 if the text changed.
+u8 spectrogram_render(Binplay* b) {
+  static const char shades[] = " .:-=+*#%@";
+  Spectrogram* sg = &b->spectrogram;
+  u32 columns = atomic_load_explicit(&sg->columns, memory_order_acquire);
+  if (sg->rendered && sg->rendered_columns == columns) {
+    return 0;
+  }
+  sg->rendered = 1;
+  sg->rendered_columns = columns;
+
+  char* it = &sg->text[0];
+  // Highest band on top
+  for (i32 row = SPECTROGRAM_ROWS - 1; row >= 0; --row) {
+    for (u32 col = 0; col < SPECTROGRAM_COLUMNS; ++col) {
+      char ch = ' ';
+      if (columns + col >= SPECTROGRAM_COLUMNS) {
+        u32 index = columns + col - SPECTROGRAM_COLUMNS;
+        u8 level = atomic_load_explicit(&sg->history[index % SPECTROGRAM_COLUMNS][row], memory_order_relaxed);
+        ch = shades[(level * (sizeof(shades) - 2)) / 255];
+      }
+      *it++ = ch;
+    }
+    *it++ = '\n';
+  }
+  snprintf(it, &sg->text[SPECTROGRAM_TEXT_SIZE] - it, "Spectrogram (%d fps, hop %d, dropped %u)\n",
+    g_spectrogram_fps,
+    g_fft_hop,
+    atomic_load_explicit(&sg->dropped, memory_order_relaxed)
+  );
+  return 1;
+}
+
+// Called from the audio thread only
+void play_position_publish(Play_position* position, i64 cursor, u32 tail, u8 valid, const Audio_state* audio) {
+  u32 sequence = atomic_load_explicit(&position->sequence, memory_order_relaxed);
+  atomic_store_explicit(&position->sequence, sequence + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&position->cursor, cursor, memory_order_relaxed);
+  atomic_store_explicit(&position->tail, tail, memory_order_relaxed);
+  atomic_store_explicit(&position->valid, valid, memory_order_relaxed);
+  atomic_store_explicit(&position->playing, audio->play, memory_order_relaxed);
+  atomic_store_explicit(&position->loop, audio->loop, memory_order_relaxed);
+  atomic_store_explicit(&position->volume, audio->volume, memory_order_relaxed);
+  atomic_store_explicit(&position->sequence, sequence + 2, memory_order_release);
+}
+
+// Returns 0 if there is no consistent position to show right now
+u8 play_position_read(Play_position* position, i64* cursor, u32* tail) {
+  for (u32 attempt = 0; attempt < 16; ++attempt) {
+    u32 sequence = atomic_load_explicit(&position->sequence, memory_order_acquire);
+    if (sequence & 1) {
+      continue;
+    }
+    *cursor = atomic_load_explicit(&position->cursor, memory_order_relaxed);
+    *tail = atomic_load_explicit(&position->tail, memory_order_relaxed);
+    u8 valid = atomic_load_explicit(&position->valid, memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&position->sequence, memory_order_relaxed) == sequence) {
+      return valid;
+    }
+  }
+  return 0;
+}
+
+// Called once per callback with the levels of the samples it produced
+void level_meters_publish(Level_meters* m, const f32* peak, const f32* sum_squares, const u32* clips, u32 frames) {
+  if (frames == 0) {
+    return;
+  }
+  const u32 channels = g_channel_count < METER_CHANNELS ? g_channel_count : METER_CHANNELS;
+  const f32 seconds = (f32)frames / g_sample_rate;
+  const f32 rms_alpha = 1.0f - expf(-seconds / METER_RMS_SECONDS);
+  const f32 peak_decay = powf(10.0f, -METER_PEAK_DECAY_DB * seconds / 20.0f);
+  const f32 full_scale = 32768.0f;
+
+  u32 sequence = atomic_load_explicit(&m->sequence, memory_order_relaxed);
+  atomic_store_explicit(&m->sequence, sequence + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  for (u32 c = 0; c < channels; ++c) {
+    const f32 mean_square = sum_squares[c] / (frames * full_scale * full_scale);
+    m->mean_square[c] += rms_alpha * (mean_square - m->mean_square[c]);
+    const f32 level = peak[c] / full_scale;
+    const f32 decayed = m->peak_level[c] * peak_decay;
+    m->peak_level[c] = level > decayed ? level : decayed;
+    atomic_store_explicit(&m->peak[c], m->peak_level[c], memory_order_relaxed);
+    atomic_store_explicit(&m->rms[c], sqrtf(m->mean_square[c]), memory_order_relaxed);
+    if (clips[c]) {
+      atomic_fetch_add_explicit(&m->clips[c], clips[c], memory_order_relaxed);
+    }
+  }
+  atomic_store_explicit(&m->sequence, sequence + 2, memory_order_release);
+}
+
+// Returns 0 if the audio thread kept publishing while we read
+u8 level_meters_read(Level_meters* m, f32* peak, f32* rms) {
+  for (u32 attempt = 0; attempt < 16; ++attempt) {
+    u32 sequence = atomic_load_explicit(&m->sequence, memory_order_acquire);
+    if (sequence & 1) {
+      continue;
+    }
+    for (u32 c = 0; c < METER_CHANNELS; ++c) {
+      peak[c] = atomic_load_explicit(&m->peak[c], memory_order_relaxed);
+      rms[c] = atomic_load_explicit(&m->rms[c], memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&m->sequence, memory_order_relaxed) == sequence) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+i32 meter_column(f32 level) {
+  f32 db = 20.0f * log10f(level + 1e-9f);
+  i32 column = (i32)((db - METER_FLOOR_DB) / -METER_FLOOR_DB * METER_WIDTH + 0.5f);
+  return CLAMP(column, 0, METER_WIDTH);
+}
+
+// One bar per channel: rms as '#', peak as '=' and the held peak as '|'. Returns 1 if the text changed.
+u8 level_meters_render(Binplay* b) {
+  Level_meters* m = &b->meters;
+  const u32 channels = g_channel_count < METER_CHANNELS ? g_channel_count : METER_CHANNELS;
+  f32 peak[METER_CHANNELS];
+  f32 rms[METER_CHANNELS];
+  if (!level_meters_read(m, peak, rms)) {
+    return 0;
+  }
+  const u64 now = clock_ns(CLOCK_MONOTONIC);
+  char text[METER_TEXT_SIZE];
+  char* it = &text[0];
+  char* end = &text[METER_TEXT_SIZE];
+  it += snprintf(it, end - it, "Levels\n");
+  for (u32 c = 0; c < channels; ++c) {
+    if (peak[c] >= m->hold[c] || now - m->hold_ns[c] > METER_HOLD_NS) {
+      m->hold[c] = peak[c];
+      m->hold_ns[c] = now;
+    }
+    u32 clips = atomic_load_explicit(&m->clips[c], memory_order_relaxed);
+    if (clips != m->seen_clips[c]) {
+      m->seen_clips[c] = clips;
+      m->clip_ns[c] = now;
+    }
+    const u8 clipping = m->clip_ns[c] != 0 && now - m->clip_ns[c] < METER_CLIP_NS;
+    const i32 rms_column = meter_column(rms[c]);
+    const i32 peak_column = meter_column(peak[c]);
+    const i32 hold_column = meter_column(m->hold[c]);
+
+    char label[4];
+    if (channels == 2) {
+      snprintf(label, sizeof(label), "%c", c == 0 ? 'L' : 'R');
+    }
+    else {
+      snprintf(label, sizeof(label), "%u", c + 1);
+    }
+    char bar[METER_WIDTH + 1];
+    for (i32 col = 0; col < METER_WIDTH; ++col) {
+      char ch = ' ';
+      if (col < rms_column) {
+        ch = '#';
+      }
+      else if (col < peak_column) {
+        ch = '=';
+      }
+      if (hold_column > 0 && col == hold_column - 1) {
+        ch = '|';
+      }
+      bar[col] = ch;
+    }
+    bar[METER_WIDTH] = 0;
+    f32 hold_db = 20.0f * log10f(m->hold[c] + 1e-9f);
+    hold_db = fabsf(hold_db) < 0.05f ? 0.0f : hold_db; // don't show -0.0
+    if (hold_db < METER_FLOOR_DB) {
+      it += snprintf(it, end - it, "%-2s [%s]   -inf dB\n", label, bar);
+    }
+    else {
+      it += snprintf(it, end - it, "%-2s [%s] %6.1f dB%s\n", label, bar, hold_db, clipping ? " CLIP" : "");
+    }
+  }
+  if (m->rendered && strcmp(text, m->text) == 0) {
+    return 0;
+  }
+  m->rendered = 1;
+  memcpy(m->text, text, sizeof(text));
+  return 1;
+}
+
+// Returns 1 if the text changed
+u8 hex_view_render(Binplay* b) {
+  Hex_view* hex = &b->hex;
+  Source* s = &b->sources[0];
+  i64 cursor = 0;
+  u32 tail = 0;
+  if (!play_position_read(&b->position, &cursor, &tail)) {
+    if (hex->rendered) {
+      return 0; // keep showing the last bytes until the reader caught up with a seek
+    }
+    cursor = s->start_pos;
+  }
+  const i64 row_of_cursor = cursor - (cursor % HEX_BYTES_PER_ROW);
+  const i64 base = row_of_cursor - HEX_ROWS_BEFORE * HEX_BYTES_PER_ROW;
+  const u32 count = HEX_ROWS * HEX_BYTES_PER_ROW;
+  u8 bytes[HEX_ROWS * HEX_BYTES_PER_ROW] = {0};
+  u8 present[HEX_ROWS * HEX_BYTES_PER_ROW] = {0};
+
+  if (hex->rendered || cursor != s->start_pos || tail != 0) {
+    // The ring holds what was just played before `tail` and what is about to be played after it.
+    // Inside an A-B loop the reader wraps at the region bounds, so bytes past them in the ring
+    // belong to the other end of the region and are not shown.
+    const u32 head = atomic_load_explicit(&s->head, memory_order_acquire);
+    const i64 region_start = atomic_load_explicit(&s->seek_region_start, memory_order_relaxed);
+    const i64 region_end = atomic_load_explicit(&s->seek_region_end, memory_order_relaxed);
+    for (u32 i = 0; i < count; ++i) {
+      i64 offset = base + i;
+      if (offset < region_start || offset >= region_end) {
+        continue;
+      }
+      u32 position = tail + (u32)(offset - cursor);
+      if ((i32)(head - position) <= 0) {
+        continue; // not read yet
+      }
+      bytes[i] = s->ring[position & (READ_AHEAD_SIZE - 1)];
+      present[i] = 1;
+    }
+    // Anything the reader may have overwritten while we copied is dropped again
+    const u32 head_after = atomic_load_explicit(&s->head, memory_order_acquire);
+    const u32 oldest = head_after - READ_AHEAD_SIZE;
+    for (u32 i = 0; i < count; ++i) {
+      u32 position = tail + (u32)(base + i - cursor);
+      if (present[i] && (i32)(position - oldest) < 0) {
+        present[i] = 0;
+      }
+    }
+  }
+
+  const u8 moved = !hex->rendered || hex->base != base || (hex->cursor - (hex->cursor % HEX_BYTES_PER_ROW)) != row_of_cursor;
+  u8 changed = 0;
+  for (u32 row = 0; row < HEX_ROWS; ++row) {
+    const u32 first = row * HEX_BYTES_PER_ROW;
+    if (!moved && memcmp(&hex->bytes[first], &bytes[first], HEX_BYTES_PER_ROW) == 0 && memcmp(&hex->present[first], &present[first], HEX_BYTES_PER_ROW) == 0) {
+      continue;
+    }
+    char line[HEX_ROW_WIDTH + 1] = {0};
+    const i64 offset = base + first;
+    u32 length = snprintf(line, sizeof(line), "%c %010llx  ", offset == row_of_cursor ? '>' : ' ', (unsigned long long)(offset < 0 ? 0 : offset));
+    for (u32 i = first; i < first + HEX_BYTES_PER_ROW; ++i) {
+      if (present[i]) {
+        length += snprintf(&line[length], sizeof(line) - length, "%02x ", bytes[i]);
+      }
+      else {
+        length += snprintf(&line[length], sizeof(line) - length, "   ");
+      }
+    }
+    line[length++] = '|';
+    for (u32 i = first; i < first + HEX_BYTES_PER_ROW; ++i) {
+      line[length++] = present[i] ? ((bytes[i] >= 32 && bytes[i] < 127) ? bytes[i] : '.') : ' ';
+    }
+    line[length++] = '|';
+    line[length++] = '\n';
+    memcpy(&hex->text[row * HEX_ROW_WIDTH], line, HEX_ROW_WIDTH);
+    changed = 1;
+  }
+  hex->text[HEX_TEXT_SIZE - 1] = 0;
+  memcpy(hex->bytes, bytes, count);
+  memcpy(hex->present, present, count);
+  hex->base = base;
+  hex->cursor = cursor;
+  hex->rendered = 1;
+  return changed;
+}
+
+// Histogram with four interleaved tables, so that runs of the same byte don't serialize
+// on a single counter, with the loop unrolled for the compiler to schedule
+void byte_histogram(const u8* data, u32 size, u32* histogram) {
+  u32 tables[4][256];
+  memset(tables, 0, sizeof(tables));
+  u32 i = 0;
+  for (; i + 16 <= size; i += 16) {
+    u64 a, c;
+    memcpy(&a, &data[i], sizeof(a));
+    memcpy(&c, &data[i + 8], sizeof(c));
+    for (u32 k = 0; k < 8; k += 2) {
+      tables[0][(a >> (8 * k)) & 0xff] += 1;
+      tables[1][(a >> (8 * (k + 1))) & 0xff] += 1;
+      tables[2][(c >> (8 * k)) & 0xff] += 1;
+      tables[3][(c >> (8 * (k + 1))) & 0xff] += 1;
+    }
+  }
+  for (; i < size; ++i) {
+    tables[0][data[i]] += 1;
+  }
+  for (u32 v = 0; v < 256; ++v) {
+    histogram[v] = tables[0][v] + tables[1][v] + tables[2][v] + tables[3][v];
+  }
+}
+
+u32 block_stats(const u32* histogram, u32 size) {
+  if (size == 0) {
+    return BLOCK_READY;
+  }
+  f32 entropy = 0.0f;
+  u32 printable = 0;
+  for (u32 v = 0; v < 256; ++v) {
+    if (histogram[v]) {
+      f32 p = (f32)histogram[v] / size;
+      entropy -= p * log2f(p);
+    }
+    if ((v >= 32 && v < 127) || v == '\n' || v == '\r' || v == '\t') {
+      printable += histogram[v];
+    }
+  }
+  u32 e = (u32)(entropy * 32.0f);
+  u32 zeros = ((u64)histogram[0] * 255) / size;
+  u32 text = ((u64)printable * 255) / size;
+  return BLOCK_READY | (e > 255 ? 255 : e) | (zeros << 8) | (text << 16);
+}
+
+void* block_index_worker(void* userdata) {
+  Binplay* b = (Binplay*)userdata;
+  Block_index* index = &b->index;
+  Source* s = &b->sources[0];
+  u8* buffer = index->buffers[atomic_fetch_add(&index->next_buffer, 1)];
+  u32 histogram[256];
+  u64 total[256] = {0};
+  i64 blocks = 0;
+  if (!buffer) {
+    return NULL;
+  }
+  while (!atomic_load(&b->done)) {
+    i64 first = atomic_fetch_add_explicit(&index->next_block, INDEX_BATCH_BLOCKS, memory_order_relaxed);
+    if (first >= index->block_count) {
+      break;
+    }
+    i64 last = first + INDEX_BATCH_BLOCKS < index->block_count ? first + INDEX_BATCH_BLOCKS : index->block_count;
+    for (i64 block = first; block < last && !atomic_load(&b->done); ++block) {
+      i64 offset = s->start_pos + block * INDEX_BLOCK_SIZE;
+      const i64 block_size = s->file_size - offset < INDEX_BLOCK_SIZE ? s->file_size - offset : INDEX_BLOCK_SIZE;
+      ssize_t bytes_read = pread(s->fd, buffer, block_size, offset);
+      u32 size = bytes_read > 0 ? bytes_read : 0;
+      byte_histogram(buffer, size, histogram);
+      for (u32 v = 0; v < 256; ++v) {
+        total[v] += histogram[v];
+      }
+      atomic_store_explicit(&index->blocks[block], block_stats(histogram, size), memory_order_release);
+      atomic_fetch_add_explicit(&index->blocks_done, 1, memory_order_relaxed);
+      blocks += 1;
+    }
+  }
+  for (u32 v = 0; v < 256; ++v) {
+    atomic_fetch_add_explicit(&index->histogram[v], total[v], memory_order_relaxed);
+  }
+  atomic_fetch_add_explicit(&index->histogram_blocks, blocks, memory_order_release);
+  return NULL;
+}
+
+Result block_index_start(Binplay* b) {
+  Block_index* index = &b->index;
+  Source* s = &b->sources[0];
+  memset(index, 0, sizeof(*index));
+  index->block_count = (s->file_size - s->start_pos + INDEX_BLOCK_SIZE - 1) / INDEX_BLOCK_SIZE;
+  if (!(index->blocks = arena_push(&b->arena, index->block_count * sizeof(*index->blocks)))) {
+    return Error;
+  }
+  // Leave a core for the audio and reader threads
+  i64 cores = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+  u32 worker_count = CLAMP(cores, 1, MAX_INDEX_WORKERS);
+  for (u32 i = 0; i < worker_count; ++i) {
+    if (!(index->buffers[i] = arena_push(&b->arena, INDEX_BLOCK_SIZE))) {
+      return Error;
+    }
+  }
+  for (u32 i = 0; i < worker_count; ++i) {
+    if (pthread_create(&index->workers[index->worker_count], NULL, block_index_worker, b) == 0) {
+      index->worker_count += 1;
+    }
+  }
+  return NoError;
+}
+
+void block_index_stop(Binplay* b) {
+  Block_index* index = &b->index;
+  for (u32 i = 0; i < index->worker_count; ++i) {
+    pthread_join(index->workers[i], NULL);
+  }
+  index->worker_count = 0;
+  // The waveform worker is joined by now, keep both for the next run before the blocks go away
+  analysis_cache_save(b);
+  index->blocks = NULL;
+  index->cached = 0;
+}
+
+u8 block_matches(u32 block, Block_kind kind) {
+  if (!(block & BLOCK_READY)) {
+    return 0;
+  }
+  f32 entropy = BLOCK_ENTROPY(block);
+  switch (kind) {
+    case BlockHighEntropy:
+      return entropy >= HIGH_ENTROPY;
+    case BlockLowEntropy:
+      return entropy <= LOW_ENTROPY;
+    case BlockText:
+      // Mostly printable, with the entropy range of natural language and source code
+      return BLOCK_TEXT(block) >= 230 && entropy >= 3.0f && entropy <= 5.5f;
+  }
+  return 0;
+}
+
+// Move the cursor to the start of the next run of matching blocks, wrapping around
+void binplay_jump_to_block(Binplay* b, Block_kind kind) {
+  Block_index* index = &b->index;
+  Source* s = &b->sources[0];
+  if (index->block_count == 0 || !index->blocks) {
+    return;
+  }
+  i64 current = (binplay_cursor(b) - s->start_pos) / INDEX_BLOCK_SIZE;
+  current = CLAMP(current, 0, index->block_count - 1);
+  u8 in_run = block_matches(atomic_load_explicit(&index->blocks[current], memory_order_acquire), kind);
+  for (i64 step = 1; step <= index->block_count; ++step) {
+    i64 block = (current + step) % index->block_count;
+    u8 matches = block_matches(atomic_load_explicit(&index->blocks[block], memory_order_acquire), kind);
+    if (block == 0) {
+      in_run = 0;
+    }
+    if (matches && !in_run) {
+      Command seek = { .type = CommandSeek, .offset = s->start_pos + block * INDEX_BLOCK_SIZE, };
+      command_queue_push(&b->commands, &seek);
+      return;
+    }
+    in_run = matches;
+  }
+}
+
+// Heatmap of the entropy per column, from light (low) to dark (high). Returns 1 if the text changed.
+u8 block_index_render(Binplay* b) {
+  static const char* shades[] = { " ", "\u2591", "\u2592", "\u2593", "\u2588", };
+  Block_index* index = &b->index;
+  Source* s = &b->sources[0];
+  const i64 data_size = s->file_size - s->start_pos;
+  i64 done = atomic_load_explicit(&index->blocks_done, memory_order_relaxed);
+  i32 column = (i32)(((binplay_cursor(b) - s->start_pos) * INDEX_COLUMNS) / (data_size > 0 ? data_size : 1));
+  column = CLAMP(column, 0, INDEX_COLUMNS - 1);
+  // Redraw at most every 1/256th of the index while it is being built, and once more when the
+  // histogram of the whole file is complete
+  const u8 summary = atomic_load_explicit(&index->histogram_blocks, memory_order_acquire) >= index->block_count;
+  i64 progress = (index->block_count > 0 ? (done * 256) / index->block_count : 0) + summary;
+  if (index->rendered && index->rendered_done == progress && index->rendered_column == column) {
+    return 0;
+  }
+  index->rendered = 1;
+  index->rendered_done = progress;
+  index->rendered_column = column;
+
+  char* it = &index->text[0];
+  char* end = &index->text[INDEX_TEXT_SIZE];
+  it += snprintf(it, end - it, "Entropy map (%lld%% indexed)\n", (long long)(index->block_count > 0 ? (100 * done) / index->block_count : 100));
+  for (u32 col = 0; col < INDEX_COLUMNS; ++col) {
+    i64 first = (index->block_count * col) / INDEX_COLUMNS;
+    i64 last = (index->block_count * (col + 1)) / INDEX_COLUMNS;
+    if (last <= first) {
+      last = first + 1;
+    }
+    f32 sum = 0.0f;
+    u32 count = 0;
+    // Sample at most 64 blocks per column so huge files stay cheap to draw
+    i64 stride = (last - first + 63) / 64;
+    for (i64 block = first; block < last && block < index->block_count; block += stride) {
+      u32 value = atomic_load_explicit(&index->blocks[block], memory_order_acquire);
+      if (value & BLOCK_READY) {
+        sum += BLOCK_ENTROPY(value);
+        count += 1;
+      }
+    }
+    const char* shade = "?";
+    if (count > 0) {
+      u32 level = (u32)((sum / count) / 8.0f * (ARR_SIZE(shades) - 1) + 0.5f);
+      shade = shades[level < ARR_SIZE(shades) ? level : ARR_SIZE(shades) - 1];
+    }
+    it += snprintf(it, end - it, "%s", shade);
+  }
+  it += snprintf(it, end - it, "\n");
+  for (i32 col = 0; col < INDEX_COLUMNS && it < end - 2; ++col) {
+    *it++ = col == column ? '^' : ' ';
+  }
+  *it++ = '\n';
+  *it = 0;
+  if (summary) {
+    block_index_summary(index, it, end - it);
+  }
+  return 1;
+}
+
+// One line about the byte histogram of the whole file, with a guess at the kind of data using
+// the same thresholds as the blocks
+void block_index_summary(Block_index* index, char* text, u32 size) {
+  u64 histogram[256];
+  u64 total = 0;
+  u64 printable = 0;
+  for (u32 v = 0; v < 256; ++v) {
+    histogram[v] = atomic_load_explicit(&index->histogram[v], memory_order_relaxed);
+    total += histogram[v];
+    if ((v >= 32 && v < 127) || v == '\n' || v == '\r' || v == '\t') {
+      printable += histogram[v];
+    }
+  }
+  if (total == 0) {
+    return;
+  }
+  f64 entropy = 0.0;
+  for (u32 v = 0; v < 256; ++v) {
+    if (histogram[v]) {
+      f64 p = (f64)histogram[v] / total;
+      entropy -= p * log2(p);
+    }
+  }
+  const f64 zeros = (f64)histogram[0] / total;
+  const f64 printable_share = (f64)printable / total;
+  const char* kind = "mixed";
+  if (entropy >= HIGH_ENTROPY) {
+    kind = "compressed or random";
+  }
+  else if (printable_share >= 230 / 255.0 && entropy >= 3.0 && entropy <= 5.5) {
+    kind = "text-like";
+  }
+  else if (zeros >= 0.5) {
+    kind = "mostly zeros";
+  }
+  else if (entropy <= LOW_ENTROPY) {
+    kind = "low entropy";
+  }
+  snprintf(text, size, "Whole file: %.2f bits/byte, %.1f%% zeros, %.1f%% printable (%s)\n", entropy, 100 * zeros, 100 * printable_share, kind);
+}
+
+// Directory of the analysis sidecars, created on demand
+void analysis_cache_dir(char* path, u32 size) {
+  const char* cache_home = getenv("XDG_CACHE_HOME");
+  const char* home = getenv("HOME");
+  if (cache_home && *cache_home) {
+    snprintf(path, size, "%s/%s", cache_home, ANALYSIS_CACHE_DIR);
+  }
+  else if (home) {
+    snprintf(path, size, "%s/.cache/%s", home, ANALYSIS_CACHE_DIR);
+  }
+  else {
+    snprintf(path, size, ".%s", ANALYSIS_CACHE_DIR);
+  }
+}
+
+u64 fnv1a(const void* data, u64 size, u64 hash) {
+  const u8* bytes = (const u8*)data;
+  for (u64 i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// Keys the analyses of the first source by the file and how its bytes are read. The sidecar
+// is named after everything but size and mtime, so a changed file replaces its old entry.
+void analysis_cache_init(Binplay* b) {
+  Analysis_cache* cache = &b->cache;
+  const Source* s = &b->sources[0];
+  memset(cache, 0, sizeof(*cache));
+  struct stat st;
+  if (!g_analysis_cache || fstat(s->fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    return;
+  }
+  Analysis_key* key = &cache->key;
+  key->device = st.st_dev;
+  key->inode = st.st_ino;
+  key->size = st.st_size;
+  key->mtime_ns = (i64)st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+  key->data_start = s->start_pos;
+  key->data_end = s->file_size;
+  key->sample_size = s->sample_size;
+  key->channel_count = s->channel_count;
+  key->big_endian = s->big_endian;
+  key->signed_bytes = s->signed_bytes;
+  key->float_samples = s->float_samples;
+  Analysis_key name = *key;
+  name.size = 0;
+  name.mtime_ns = 0;
+  char dir[MAX_FILE_SIZE] = {0};
+  analysis_cache_dir(dir, MAX_FILE_SIZE);
+  snprintf(cache->path, MAX_FILE_SIZE, "%s/%016llx.bin", dir, (unsigned long long)fnv1a(&name, sizeof(name), 0xcbf29ce484222325ull));
+  cache->enabled = 1;
+}
+
+// Maps the sidecar and takes the waveform and block index from it without scanning the file.
+// Anything that doesn't match the file as it is now counts as a miss. Returns 1 on a hit.
+u8 analysis_cache_load(Binplay* b) {
+  Analysis_cache* cache = &b->cache;
+  if (!cache->enabled) {
+    return 0;
+  }
+  i32 fd = open(cache->path, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  struct stat st;
+  const Analysis_cache_header* header = MAP_FAILED;
+  const u64 header_size = sizeof(Analysis_cache_header);
+  if (fstat(fd, &st) == 0 && (u64)st.st_size >= header_size) {
+    header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (header == MAP_FAILED) {
+    return 0;
+  }
+  const u64 expected_size = header_size + (2 * WAVEFORM_BASE_BINS + (u64)header->block_count) * sizeof(u32);
+  if (memcmp(header->magic, ANALYSIS_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != ANALYSIS_CACHE_VERSION ||
+      memcmp(&header->key, &cache->key, sizeof(cache->key)) != 0 ||
+      header->waveform_bins != 2 * WAVEFORM_BASE_BINS ||
+      header->index_block_size != INDEX_BLOCK_SIZE ||
+      header->block_count < 0 ||
+      (u64)st.st_size != expected_size) {
+    munmap((void*)header, st.st_size);
+    return 0;
+  }
+  cache->map = (void*)header;
+  cache->map_size = st.st_size;
+  cache->loaded = 1;
+
+  const u32* bins = (const u32*)&header[1];
+  Waveform* w = &b->waveform;
+  for (u32 i = 0; i < 2 * WAVEFORM_BASE_BINS; ++i) {
+    atomic_store_explicit(&w->bins[i], bins[i], memory_order_relaxed);
+    atomic_store_explicit(&w->state[i], BinExact, memory_order_relaxed);
+  }
+  atomic_store_explicit(&w->bins_scanned, WAVEFORM_BASE_BINS, memory_order_relaxed);
+  atomic_fetch_add_explicit(&w->revision, 1, memory_order_release);
+
+  // The blocks are used in place, they are never written once complete
+  Block_index* index = &b->index;
+  index->block_count = header->block_count;
+  index->blocks = (_Atomic u32*)&bins[2 * WAVEFORM_BASE_BINS];
+  index->cached = 1;
+  atomic_store(&index->next_block, index->block_count);
+  atomic_store(&index->blocks_done, index->block_count);
+  for (u32 v = 0; v < 256; ++v) {
+    atomic_store(&index->histogram[v], header->histogram[v]);
+  }
+  atomic_store(&index->histogram_blocks, index->block_count);
+  return 1;
+}
+
+// Called once the workers are joined. Only complete analyses of an unchanged file are kept,
+// written to a temporary file first so a reader never maps half a sidecar.
+void analysis_cache_save(Binplay* b) {
+  Analysis_cache* cache = &b->cache;
+  Waveform* w = &b->waveform;
+  Block_index* index = &b->index;
+  if (!cache->enabled || cache->loaded || !index->blocks ||
+      atomic_load(&w->bins_scanned) != WAVEFORM_BASE_BINS ||
+      atomic_load(&index->blocks_done) != index->block_count) {
+    return;
+  }
+  struct stat st;
+  if (fstat(b->sources[0].fd, &st) < 0 || st.st_size != cache->key.size ||
+      (i64)st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec != cache->key.mtime_ns) {
+    return;
+  }
+  char dir[MAX_FILE_SIZE] = {0};
+  analysis_cache_dir(dir, MAX_FILE_SIZE);
+  char* parent = strrchr(dir, '/');
+  if (parent) {
+    *parent = 0;
+    mkdir(dir, 0755);
+    *parent = '/';
+  }
+  mkdir(dir, 0755);
+
+  Analysis_cache_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, ANALYSIS_CACHE_MAGIC, sizeof(header.magic));
+  header.version = ANALYSIS_CACHE_VERSION;
+  header.key = cache->key;
+  header.waveform_bins = 2 * WAVEFORM_BASE_BINS;
+  header.index_block_size = INDEX_BLOCK_SIZE;
+  header.block_count = index->block_count;
+  for (u32 v = 0; v < 256; ++v) {
+    header.histogram[v] = atomic_load(&index->histogram[v]);
+  }
+  static u32 bins[2 * WAVEFORM_BASE_BINS];
+  for (u32 i = 0; i < 2 * WAVEFORM_BASE_BINS; ++i) {
+    bins[i] = atomic_load_explicit(&w->bins[i], memory_order_relaxed);
+  }
+
+  char temp_path[MAX_FILE_SIZE + 32] = {0};
+  snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", cache->path, (i32)getpid());
+  FILE* fp = fopen(temp_path, "wb");
+  if (!fp) {
+    return;
+  }
+  u8 written = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+    fwrite(bins, sizeof(bins), 1, fp) == 1 &&
+    fwrite((const void*)index->blocks, sizeof(u32), index->block_count, fp) == (size_t)index->block_count;
+  if (fclose(fp) != 0 || !written || rename(temp_path, cache->path) != 0) {
+    unlink(temp_path);
+  }
+}
+
+void analysis_cache_close(Binplay* b) {
+  Analysis_cache* cache = &b->cache;
+  if (cache->map) {
+    munmap(cache->map, cache->map_size);
+  }
+  cache->map = NULL;
+  cache->map_size = 0;
+  cache->loaded = 0;
+}
+
+// Expands `path` into the files to render: everything under a directory, or the paths listed
+// in a file, one per line
+Result batch_collect(Batch* batch, const char* path) {
+  struct stat st;
+  if (stat(path, &st) < 0) {
+    fprintf(stderr, "Failed to stat '%s'\n", path);
+    return Error;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    return batch_collect_dir(batch, path);
+  }
+  FILE* fp = fopen(path, "r");
+  if (!fp) {
+    fprintf(stderr, "Failed to open file list '%s'\n", path);
+    return Error;
+  }
+  Result result = NoError;
+  char line[MAX_FILE_SIZE];
+  while (fgets(line, sizeof(line), fp)) {
+    line[strcspn(line, "\r\n")] = 0;
+    if (line[0] == 0 || line[0] == '#') {
+      continue;
+    }
+    if (batch_add_path(batch, line) != NoError) {
+      return_defer(Error);
+    }
+  }
+defer:
+  fclose(fp);
+  return result;
+}
+
+Result batch_collect_dir(Batch* batch, const char* path) {
+  DIR* dir = opendir(path);
+  if (!dir) {
+    fprintf(stderr, "Failed to open directory '%s'\n", path);
+    return Error;
+  }
+  Result result = NoError;
+  struct dirent* entry;
+  while ((entry = readdir(dir))) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    char child[MAX_FILE_SIZE];
+    if (snprintf(child, sizeof(child), "%s/%s", path, entry->d_name) >= (i32)sizeof(child)) {
+      continue;
+    }
+    struct stat st;
+    if (stat(child, &st) < 0) {
+      continue;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      if (batch_collect_dir(batch, child) != NoError) {
+        return_defer(Error);
+      }
+    }
+    else if (S_ISREG(st.st_mode) && batch_add_path(batch, child) != NoError) {
+      return_defer(Error);
+    }
+  }
+defer:
+  closedir(dir);
+  return result;
+}
+
+Result batch_add_path(Batch* batch, const char* path) {
+  if (batch->path_count == batch->path_capacity) {
+    u32 capacity = batch->path_capacity ? 2 * batch->path_capacity : 1024;
+    char** paths = realloc(batch->paths, capacity * sizeof(char*));
+    if (!paths) {
+      return Error;
+    }
+    batch->paths = paths;
+    batch->path_capacity = capacity;
+  }
+  if (!(batch->paths[batch->path_count] = strdup(path))) {
+    return Error;
+  }
+  batch->path_count += 1;
+  return NoError;
+}
+
+// Called by the owner only
+Result batch_deque_push(Batch_deque* deque, u64 task) {
+  const i64 bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  const i64 top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  if (bottom - top >= BATCH_DEQUE_SIZE) {
+    return Error;
+  }
+  atomic_store_explicit(&deque->tasks[bottom & (BATCH_DEQUE_SIZE - 1)], task, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+  return NoError;
+}
+
+// Called by the owner only, takes the newest task
+u8 batch_deque_take(Batch_deque* deque, u64* task) {
+  const i64 bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+  atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  i64 top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+  u8 taken = 0;
+  if (top <= bottom) {
+    *task = atomic_load_explicit(&deque->tasks[bottom & (BATCH_DEQUE_SIZE - 1)], memory_order_relaxed);
+    taken = 1;
+    if (top == bottom) {
+      // Last task, race the thieves for it
+      taken = atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed);
+      atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+  }
+  else {
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+  }
+  return taken;
+}
+
+// Called by any other worker, takes the oldest (and so largest) task
+u8 batch_deque_steal(Batch_deque* deque, u64* task) {
+  i64 top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  const i64 bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+  if (top >= bottom) {
+    return 0;
+  }
+  *task = atomic_load_explicit(&deque->tasks[top & (BATCH_DEQUE_SIZE - 1)], memory_order_relaxed);
+  return atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed);
+}
+
+// Takes a free slot and opens the next file that can be rendered into it. Returns 0 when all
+// files are taken or as many are open as there are slots.
+u8 batch_open_next(Batch* batch, u64* task) {
+  while (atomic_load_explicit(&batch->next_path, memory_order_relaxed) < batch->path_count) {
+    u32 slot = 0;
+    for (; slot < BATCH_MAX_OPEN_FILES; ++slot) {
+      i32 expected = 0;
+      if (atomic_compare_exchange_strong(&batch->files[slot].used, &expected, 1)) {
+        break;
+      }
+    }
+    if (slot == BATCH_MAX_OPEN_FILES) {
+      return 0;
+    }
+    atomic_fetch_add(&batch->active_files, 1);
+    const u32 index = atomic_fetch_add(&batch->next_path, 1);
+    if (index < batch->path_count && batch_file_open(batch, &batch->files[slot], index) == NoError) {
+      // Nothing of the slot's last file is in flight any more, and the tasks of this one only
+      // reach the other workers through the deque
+      for (u32 i = 0; batch->scan && i < batch->worker_count; ++i) {
+        memset(&batch->workers[i].sums[slot], 0, sizeof(Feature_sums));
+      }
+      *task = BATCH_TASK(slot, 0, batch->files[slot].chunk_count);
+      return 1;
+    }
+    if (index < batch->path_count) {
+      atomic_fetch_add(&batch->files_failed, 1);
+    }
+    batch_file_release(batch, &batch->files[slot]);
+  }
+  return 0;
+}
+
+// Opens the input with the same format rules as playback, and unless scanning creates its wav
+Result batch_file_open(Batch* batch, Batch_file* file, u32 index) {
   Result result = NoError;
-  PaError err = Pa_Initialize();
-  if (err != paNoError) {
-    Pa_Terminate();
-    fprintf(stderr, "PortAudio Error: %s\n", Pa_GetErrorText(err));
+  Source* s = &file->source;
+  const char* path = batch->paths[index];
+  file->path = path;
+  file->index = index;
+  file->out_fd = -1;
+  file->start_time = cpu_time_now(CLOCK_MONOTONIC);
+  atomic_store(&file->chunks_done, 0);
+  atomic_store(&file->failed, 0);
+  if (source_open_file(s, path, g_sample_size, g_channel_count) != NoError) {
+    return_defer(Error);
+  }
+  const i64 frame_size = s->sample_size * s->channel_count;
+  if (frame_size > BATCH_BLOCK_SIZE) {
+    fprintf(stderr, "'%s' has frames of %lld bytes, more than a batch block\n", path, (long long)frame_size);
+    return_defer(Error);
+  }
+  file->sample_rate = g_sample_rate ? g_sample_rate : (s->sample_rate ? s->sample_rate : SAMPLE_RATE);
+  file->frame_count = (s->file_size - s->start_pos) / frame_size;
+  file->chunk_frames = BATCH_CHUNK_SIZE / frame_size;
+  if (file->chunk_frames * BATCH_MAX_CHUNKS < file->frame_count) {
+    file->chunk_frames = (file->frame_count + BATCH_MAX_CHUNKS - 1) / BATCH_MAX_CHUNKS;
+  }
+  file->chunk_count = (file->frame_count + file->chunk_frames - 1) / file->chunk_frames;
+  if (!batch->scan && batch_output_open(file) != NoError) {
     return_defer(Error);
   }
+defer:
+  return result;
+}
 
-  i32 output_device = Pa_GetDefaultOutputDevice();
-  output_port.device = output_device;
-  output_port.channelCount = g_channel_count;
-  output_port.sampleFormat = paInt16;
-  output_port.suggestedLatency = Pa_GetDeviceInfo(output_port.device)->defaultHighOutputLatency;
-  output_port.hostApiSpecificStreamInfo = NULL;
+// Creates the wav of the file, sized up front so that every chunk can be written on its own
+Result batch_output_open(Batch_file* file) {
+  Result result = NoError;
+  const Source* s = &file->source;
+  const char* path = file->path;
 
-  if ((err = Pa_IsFormatSupported(NULL, &output_port, g_sample_rate)) != paFormatIsSupported) {
-    fprintf(stderr, "PortAudio Error: %s\n", Pa_GetErrorText(err));
+  // One output per input, named after its whole path so that files from different
+  // directories don't collide
+  const char* name = path;
+  while (*name == '/' || (name[0] == '.' && name[1] == '/')) {
+    name += *name == '/' ? 1 : 2;
+  }
+  i32 length = snprintf(file->output, MAX_FILE_SIZE, "%s/", g_batch_output);
+  for (; *name && length < MAX_FILE_SIZE - 5; ++name) {
+    file->output[length++] = *name == '/' ? '_' : *name;
+  }
+  snprintf(&file->output[length], MAX_FILE_SIZE - length, ".wav");
+
+  const i64 data_size = file->frame_count * s->channel_count * (i64)sizeof(i16);
+  u8 header[BATCH_WAV_HEADER_SIZE];
+  wav_header_write(header, data_size, s->channel_count, file->sample_rate);
+  if ((file->out_fd = open(file->output, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    fprintf(stderr, "Failed to create '%s'\n", file->output);
     return_defer(Error);
   }
+  if (pwrite(file->out_fd, header, sizeof(header), 0) != sizeof(header) || ftruncate(file->out_fd, sizeof(header) + data_size) < 0) {
+    fprintf(stderr, "Failed to write '%s'\n", file->output);
+    return_defer(Error);
+  }
+defer:
+  return result;
+}
+
+// Renders the task, splitting off its back half for thieves until a single chunk is left
+void batch_run_task(Batch* batch, Batch_worker* worker, u64 task) {
+  const u32 slot = BATCH_TASK_SLOT(task);
+  u32 first = BATCH_TASK_FIRST(task);
+  u32 end = BATCH_TASK_END(task);
+  while (end - first > 1) {
+    const u32 middle = first + (end - first) / 2;
+    if (batch_deque_push(&worker->deque, BATCH_TASK(slot, middle, end)) != NoError) {
+      break;
+    }
+    end = middle;
+  }
 
-  err = Pa_OpenStream(
-    &stream,
-    NULL,
-    &output_port,
-    g_sample_rate,
-    g_frames_per_buffer,
-    paNoFlag,
-    stereo_callback,
-    NULL
-  );
-  if (err != paNoError) {
-    Pa_Terminate();
-    fprintf(stderr, "PortAudio Error: %s\n", Pa_GetErrorText(err));
+  Batch_file* file = &batch->files[slot];
+  Source* s = &file->source;
+  const i64 frame_size = s->sample_size * s->channel_count;
+  const i64 out_frame_size = s->channel_count * sizeof(i16);
+  const u32 block_frames = BATCH_BLOCK_SIZE / frame_size < BATCH_BLOCK_FRAMES ? BATCH_BLOCK_SIZE / frame_size : BATCH_BLOCK_FRAMES;
+  i64 frame = first * file->chunk_frames;
+  const i64 last = end * file->chunk_frames < file->frame_count ? end * file->chunk_frames : file->frame_count;
+  while (frame < last && !atomic_load_explicit(&file->failed, memory_order_relaxed)) {
+    // Blocks stay within a chunk and the ffts restart with every chunk, so features don't
+    // depend on how the tasks were split
+    const i64 chunk_end = (frame / file->chunk_frames + 1) * file->chunk_frames;
+    const i64 block_end = chunk_end < last ? chunk_end : last;
+    const u32 frames = block_end - frame < block_frames ? block_end - frame : block_frames;
+    if (frame % file->chunk_frames == 0) {
+      worker->fft_fill = 0;
+    }
+    const u32 size = frames * frame_size;
+    u32 bytes_read = 0;
+    while (bytes_read < size) {
+      ssize_t n = pread(s->fd, &worker->input[bytes_read], size - bytes_read, s->start_pos + frame * frame_size + bytes_read);
+      if (n <= 0) {
+        break;
+      }
+      bytes_read += n;
+    }
+    // A file that shrank underneath us renders as silence from there
+    memset(&worker->input[bytes_read], s->sample_size == 1 && !s->signed_bytes ? 128 : 0, size - bytes_read);
+
+    const u32 count = frames * s->channel_count;
+    source_decode(s, worker->input, count, worker->samples);
+    atomic_fetch_add_explicit(&batch->bytes_in, size, memory_order_relaxed);
+    if (batch->scan) {
+      feature_accumulate(batch, worker, &worker->sums[slot], worker->input, size, worker->samples, frames, s->channel_count);
+      frame += frames;
+      continue;
+    }
+    memset(worker->bus, 0, count * sizeof(f32));
+    source_route(s, worker->samples, frames, worker->bus, s->channel_count);
+    for (u32 i = 0; i < count; ++i) {
+      f32 sample = g_volume * worker->bus[i] * 32768.0f;
+      sample = CLAMP(sample, -32768.0f, 32767.0f);
+      worker->output[i] = (i16)sample;
+    }
+    if (pwrite(file->out_fd, worker->output, count * sizeof(i16), BATCH_WAV_HEADER_SIZE + frame * out_frame_size) != (ssize_t)(count * sizeof(i16))) {
+      // Reported once per file, by whichever worker hits it first
+      if (atomic_exchange(&file->failed, 1) == 0) {
+        fprintf(stderr, "Failed to write '%s'\n", file->output);
+      }
+      break;
+    }
+    atomic_fetch_add_explicit(&batch->bytes_out, count * sizeof(i16), memory_order_relaxed);
+    frame += frames;
+  }
+
+  if (atomic_fetch_add(&file->chunks_done, end - first) + (end - first) == file->chunk_count) {
+    if (atomic_load(&file->failed)) {
+      atomic_fetch_add(&batch->files_failed, 1);
+      batch_file_release(batch, file);
+      return;
+    }
+    const f64 seconds = cpu_time_now(CLOCK_MONOTONIC) - file->start_time;
+    const f64 megabytes = (f64)file->frame_count * frame_size / (1024 * 1024);
+    if (batch->scan) {
+      feature_finish(batch, file, slot);
+    }
+    if (!batch->quiet) {
+      fprintf(stdout, "%s%s%s: %.1f MB in %.3f s (%.1f MB/s)\n", file->path, batch->scan ? "" : " -> ", batch->scan ? "" : file->output, megabytes, seconds, seconds > 0 ? megabytes / seconds : 0.0);
+    }
+    atomic_fetch_add(&batch->files_done, 1);
+    batch_file_release(batch, file);
+  }
+}
+
+void batch_file_release(Batch* batch, Batch_file* file) {
+  if (file->source.fd >= 0) {
+    close(file->source.fd);
+    file->source.fd = -1;
+  }
+  if (file->out_fd >= 0) {
+    close(file->out_fd);
+    file->out_fd = -1;
+  }
+  atomic_fetch_sub(&batch->active_files, 1);
+  atomic_store(&file->used, 0);
+}
+
+void* batch_worker_thread(void* userdata) {
+  Batch_worker* worker = (Batch_worker*)userdata;
+  Batch* batch = &g_batch;
+  u64 task = 0;
+  for (;;) {
+    // Own work first, newest first so the chunks of a file stay with its worker
+    if (batch_deque_take(&worker->deque, &task)) {
+      batch_run_task(batch, worker, task);
+      continue;
+    }
+    u8 stolen = 0;
+    worker->seed = worker->seed * 1103515245u + 12345u;
+    for (u32 i = 0; i < batch->worker_count && !stolen; ++i) {
+      Batch_worker* victim = &batch->workers[(worker->seed + i) % batch->worker_count];
+      stolen = victim != worker && batch_deque_steal(&victim->deque, &task);
+    }
+    if (stolen) {
+      worker->steals += 1;
+      batch_run_task(batch, worker, task);
+      continue;
+    }
+    // Only start on another file once nothing is left to steal, so open files stay few
+    if (batch_open_next(batch, &task)) {
+      batch_run_task(batch, worker, task);
+      continue;
+    }
+    if (atomic_load(&batch->next_path) >= batch->path_count && atomic_load(&batch->active_files) == 0) {
+      break;
+    }
+    usleep(BATCH_IDLE_US);
+  }
+  return NULL;
+}
+
+// Renders every file of `g_batch_path` to a 16 bit wav in `g_batch_output`, or with
+// `g_feature_index` writes their feature vectors there
+Result batch_run() {
+  Result result = NoError;
+  Batch* batch = &g_batch;
+  batch->scan = g_feature_index != NULL;
+  if (batch_collect(batch, g_batch_path) != NoError) {
     return_defer(Error);
   }
+  if (!batch->scan && mkdir(g_batch_output, 0755) < 0 && errno != EEXIST) {
+    fprintf(stderr, "Failed to create output directory '%s'\n", g_batch_output);
+    return_defer(Error);
+  }
+  if (batch_process(batch) != NoError) {
+    return_defer(Error);
+  }
+  if (batch->scan && feature_index_write(batch, g_feature_index) != NoError) {
+    return_defer(Error);
+  }
+  if (atomic_load(&batch->files_failed) > 0) {
+    result = Error;
+  }
 defer:
+  batch_free(batch);
   return result;
 }
 
-Result binplay_start_stream(Binplay* b) {
-  PaError err = Pa_StartStream(stream);
-  if (err != paNoError) {
-    Pa_Terminate();
-    fprintf(stderr, "PortAudio Error: %s\n", Pa_GetErrorText(err));
+// Runs the pool over the paths of the batch until every file is done or failed
+Result batch_process(Batch* batch) {
+  Result result = NoError;
+  i64 cores = g_jobs > 0 ? g_jobs : sysconf(_SC_NPROCESSORS_ONLN);
+  const u32 worker_count = CLAMP(cores, 1, BATCH_MAX_WORKERS);
+  const f64 start_time = cpu_time_now(CLOCK_MONOTONIC);
+  for (u32 i = 0; i < worker_count; ++i) {
+    Batch_worker* worker = &batch->workers[i];
+    worker->index = i;
+    worker->seed = i + 1;
+    worker->input = malloc(BATCH_BLOCK_SIZE);
+    worker->samples = malloc(BATCH_BLOCK_SIZE * sizeof(f32));
+    worker->bus = malloc(BATCH_BLOCK_SIZE * sizeof(f32));
+    worker->output = malloc(BATCH_BLOCK_SIZE * sizeof(i16));
+    if (!worker->input || !worker->samples || !worker->bus || !worker->output) {
+      return_defer(Error);
+    }
+    if (batch->scan) {
+      worker->sums = calloc(BATCH_MAX_OPEN_FILES, sizeof(Feature_sums));
+      worker->fft_memory = malloc(fft_memory_size(FEATURE_FFT_SIZE));
+      if (!worker->sums || !worker->fft_memory) {
+        return_defer(Error);
+      }
+      fft_init(&worker->fft, FEATURE_FFT_SIZE, worker->fft_memory);
+    }
+  }
+  if (batch->scan) {
+    batch->features = calloc((u64)batch->path_count * FEATURE_DIMS, sizeof(f32));
+    batch->feature_done = calloc(batch->path_count ? batch->path_count : 1, 1);
+    if (!batch->features || !batch->feature_done) {
+      return_defer(Error);
+    }
+    for (u32 bin = 1; bin < FEATURE_FFT_SIZE / 2; ++bin) {
+      batch->feature_band[bin] = (u8)(log2f(bin) * FEATURE_BANDS / log2f(FEATURE_FFT_SIZE / 2));
+    }
+  }
+  for (u32 i = 0; i < BATCH_MAX_OPEN_FILES; ++i) {
+    batch->files[i].source.fd = -1;
+    batch->files[i].out_fd = -1;
+  }
+  batch->worker_count = worker_count;
+  for (u32 i = 0; i < worker_count; ++i) {
+    if (pthread_create(&batch->workers[i].thread, NULL, batch_worker_thread, &batch->workers[i]) != 0) {
+      // The workers that did start pick up all of the work
+      batch->worker_count = i;
+      break;
+    }
+  }
+  if (batch->worker_count == 0) {
+    fprintf(stderr, "Failed to start batch workers\n");
+    return_defer(Error);
+  }
+  u64 steals = 0;
+  for (u32 i = 0; i < batch->worker_count; ++i) {
+    pthread_join(batch->workers[i].thread, NULL);
+    steals += batch->workers[i].steals;
+  }
+  const f64 seconds = cpu_time_now(CLOCK_MONOTONIC) - start_time;
+  const f64 megabytes = atomic_load(&batch->bytes_in) / (1024.0 * 1024.0);
+  if (!batch->quiet) {
+    fprintf(stdout, "%s %u of %u files (%u failed) with %u workers: %.1f MB in %.3f s (%.1f MB/s, %.1f files/s, %.1f MB written, %llu steals)\n",
+      batch->scan ? "Scanned" : "Rendered",
+      atomic_load(&batch->files_done),
+      batch->path_count,
+      atomic_load(&batch->files_failed),
+      batch->worker_count,
+      megabytes,
+      seconds,
+      seconds > 0 ? megabytes / seconds : 0.0,
+      seconds > 0 ? atomic_load(&batch->files_done) / seconds : 0.0,
+      atomic_load(&batch->bytes_out) / (1024.0 * 1024.0),
+      (unsigned long long)steals
+    );
+  }
+defer:
+  return result;
+}
+
+void batch_free(Batch* batch) {
+  for (u32 i = 0; i < BATCH_MAX_WORKERS; ++i) {
+    free(batch->workers[i].input);
+    free(batch->workers[i].samples);
+    free(batch->workers[i].bus);
+    free(batch->workers[i].output);
+    free(batch->workers[i].sums);
+    free(batch->workers[i].fft_memory);
+  }
+  for (u32 i = 0; i < batch->path_count; ++i) {
+    free(batch->paths[i]);
+  }
+  free(batch->paths);
+  free(batch->features);
+  free(batch->feature_done);
+}
+
+// 16 bit pcm header of BATCH_WAV_HEADER_SIZE bytes. Room for a ds64 chunk is always kept (as
+// JUNK), outputs past 4 GB are written as RF64 with the sizes in there.
+void wav_header_write(u8* header, i64 data_size, i32 channel_count, i32 sample_rate) {
+  const u8 rf64 = data_size > 0xffffffffll - BATCH_WAV_HEADER_SIZE;
+  const i64 riff_size = BATCH_WAV_HEADER_SIZE - 8 + data_size;
+  const i32 block_align = channel_count * sizeof(i16);
+  u8* p = header;
+  memset(header, 0, BATCH_WAV_HEADER_SIZE);
+  memcpy(p, rf64 ? "RF64" : "RIFF", 4);
+  p = put_le(p + 4, rf64 ? 0xffffffff : riff_size, 4);
+  memcpy(p, "WAVE", 4);
+  memcpy(p + 4, rf64 ? "ds64" : "JUNK", 4);
+  p = put_le(p + 8, 28, 4);
+  if (rf64) {
+    put_le(p, riff_size, 8);
+    put_le(p + 8, data_size, 8);
+    put_le(p + 16, data_size / block_align, 8);
+  }
+  p += 28;
+  memcpy(p, "fmt ", 4);
+  p = put_le(p + 4, 16, 4);
+  p = put_le(p, 1, 2);
+  p = put_le(p, channel_count, 2);
+  p = put_le(p, sample_rate, 4);
+  p = put_le(p, (i64)sample_rate * block_align, 4);
+  p = put_le(p, block_align, 2);
+  p = put_le(p, 16, 2);
+  memcpy(p, "data", 4);
+  put_le(p + 4, rf64 ? 0xffffffff : data_size, 4);
+}
+
+u8* put_le(u8* p, u64 value, u32 size) {
+  for (u32 i = 0; i < size; ++i) {
+    p[i] = (value >> (8 * i)) & 0xff;
+  }
+  return p + size;
+}
+
+// Adds a block of a task to the sums: the byte histogram of the raw data, and the spectrum of
+// the mono mix in back to back ffts
+void feature_accumulate(Batch* batch, Batch_worker* worker, Feature_sums* sums, const u8* data, u32 size, const f32* samples, u32 frames, i32 channel_count) {
+  u32 histogram[256];
+  byte_histogram(data, size, histogram);
+  for (u32 v = 0; v < 256; ++v) {
+    sums->histogram[v] += histogram[v];
+  }
+  Fft* fft = &worker->fft;
+  const u32 half = FEATURE_FFT_SIZE / 2;
+  for (u32 i = 0; i < frames; ++i) {
+    f32 sample = 0.0f;
+    for (i32 c = 0; c < channel_count; ++c) {
+      sample += samples[i * channel_count + c];
+    }
+    sample /= channel_count;
+    sums->square_sum += sample * sample;
+    fft->input[worker->fft_fill] = sample * fft->window[worker->fft_fill];
+    if (++worker->fft_fill < FEATURE_FFT_SIZE) {
+      continue;
+    }
+    worker->fft_fill = 0;
+    fft_forward(fft);
+    f64 power_sum = 0.0;
+    f64 log_sum = 0.0;
+    for (u32 bin = 1; bin < half; ++bin) {
+      // The floor keeps the flatness of silent ffts finite
+      const f64 power = (f64)fft->re[bin] * fft->re[bin] + (f64)fft->im[bin] * fft->im[bin] + 1e-12;
+      sums->band_power[batch->feature_band[bin]] += power;
+      sums->weighted_power += power * bin;
+      power_sum += power;
+      log_sum += log(power);
+    }
+    sums->power += power_sum;
+    sums->flatness += exp(log_sum / (half - 1)) / (power_sum / (half - 1));
+    sums->ffts += 1;
+  }
+  sums->samples += frames;
+}
+
+// Called by the worker that finished the file's last chunk, once every other worker is done
+// with it. All features are scaled to about 0..1.
+void feature_finish(Batch* batch, Batch_file* file, u32 slot) {
+  Feature_sums total;
+  memset(&total, 0, sizeof(total));
+  for (u32 i = 0; i < batch->worker_count; ++i) {
+    const Feature_sums* sums = &batch->workers[i].sums[slot];
+    for (u32 v = 0; v < 256; ++v) {
+      total.histogram[v] += sums->histogram[v];
+    }
+    for (u32 band = 0; band < FEATURE_BANDS; ++band) {
+      total.band_power[band] += sums->band_power[band];
+    }
+    total.power += sums->power;
+    total.weighted_power += sums->weighted_power;
+    total.flatness += sums->flatness;
+    total.square_sum += sums->square_sum;
+    total.ffts += sums->ffts;
+    total.samples += sums->samples;
+  }
+  f32* features = &batch->features[(u64)file->index * FEATURE_DIMS];
+  for (u32 band = 0; band < FEATURE_BANDS; ++band) {
+    features[band] = total.power > 0.0 ? total.band_power[band] / total.power : 0.0f;
+  }
+  features[FEATURE_BANDS] = total.power > 0.0 ? total.weighted_power / total.power / (FEATURE_FFT_SIZE / 2) : 0.0f;
+  features[FEATURE_BANDS + 1] = total.ffts ? total.flatness / total.ffts : 0.0f;
+  const f64 level = total.samples ? 10.0 * log10(total.square_sum / total.samples + 1e-10) : -100.0;
+  features[FEATURE_BANDS + 2] = CLAMP((level + 100.0) / 100.0, 0.0, 1.0);
+  u64 bytes = 0;
+  for (u32 v = 0; v < 256; ++v) {
+    bytes += total.histogram[v];
+  }
+  f64 entropy = 0.0;
+  for (u32 v = 0; v < 256 && bytes; ++v) {
+    if (total.histogram[v]) {
+      const f64 p = (f64)total.histogram[v] / bytes;
+      entropy -= p * log2(p);
+    }
+  }
+  features[FEATURE_BANDS + 3] = entropy / 8.0;
+  batch->feature_done[file->index] = 1;
+}
+
+Result feature_index_write(Batch* batch, const char* path) {
+  Feature_index_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, FEATURE_INDEX_MAGIC, sizeof(header.magic));
+  header.version = FEATURE_INDEX_VERSION;
+  header.dims = FEATURE_DIMS;
+  header.sample_size = g_sample_size;
+  header.channel_count = g_channel_count;
+  for (u32 i = 0; i < batch->path_count; ++i) {
+    if (batch->feature_done[i]) {
+      header.count += 1;
+      header.names_size += strlen(batch->paths[i]) + 1;
+    }
+  }
+
+  char temp_path[MAX_FILE_SIZE + 32] = {0};
+  snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path, (i32)getpid());
+  FILE* fp = fopen(temp_path, "wb");
+  if (!fp) {
+    fprintf(stderr, "Failed to create '%s'\n", temp_path);
+    return Error;
+  }
+  u8 written = fwrite(&header, sizeof(header), 1, fp) == 1;
+  u32 name_offset = 0;
+  for (u32 i = 0; i < batch->path_count && written; ++i) {
+    if (!batch->feature_done[i]) {
+      continue;
+    }
+    Feature_record record;
+    memset(&record, 0, sizeof(record));
+    memcpy(record.features, &batch->features[(u64)i * FEATURE_DIMS], sizeof(record.features));
+    record.name_offset = name_offset;
+    record.name_length = strlen(batch->paths[i]);
+    name_offset += record.name_length + 1;
+    written = fwrite(&record, sizeof(record), 1, fp) == 1;
+  }
+  for (u32 i = 0; i < batch->path_count && written; ++i) {
+    if (batch->feature_done[i]) {
+      written = fwrite(batch->paths[i], strlen(batch->paths[i]) + 1, 1, fp) == 1;
+    }
+  }
+  if (fclose(fp) != 0 || !written || rename(temp_path, path) != 0) {
+    fprintf(stderr, "Failed to write '%s'\n", path);
+    unlink(temp_path);
     return Error;
   }
   return NoError;
 }
 
-i32 binplay_process_audio(void* output) {
+// Scans `g_query_path` with the interpretation the index was built with and prints the
+// `g_neighbours` nearest files. Every feature is scaled by its spread over the index, so that
+// none of them dominates the distance.
+Result feature_query() {
+  Result result = NoError;
+  Batch* batch = &g_batch;
+  const Feature_index_header* header = MAP_FAILED;
+  u64 map_size = 0;
+  Neighbour* neighbours = NULL;
+  if (!g_feature_index) {
+    fprintf(stderr, "--query needs the --features index to search\n");
+    return_defer(Error);
+  }
+  i32 fd = open(g_feature_index, O_RDONLY);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0 && (u64)st.st_size >= sizeof(Feature_index_header)) {
+    map_size = st.st_size;
+    header = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (header == MAP_FAILED ||
+      memcmp(header->magic, FEATURE_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != FEATURE_INDEX_VERSION ||
+      header->dims != FEATURE_DIMS ||
+      map_size != sizeof(*header) + (u64)header->count * sizeof(Feature_record) + header->names_size) {
+    fprintf(stderr, "'%s' is not a feature index\n", g_feature_index);
+    return_defer(Error);
+  }
+  const Feature_record* records = (const Feature_record*)&header[1];
+  const char* names = (const char*)&records[header->count];
+
+  if (!g_sample_size) {
+    g_sample_size = header->sample_size;
+  }
+  if (!g_channel_count) {
+    g_channel_count = header->channel_count;
+  }
+  batch->scan = 1;
+  batch->quiet = 1;
+  if (batch_add_path(batch, g_query_path) != NoError || batch_process(batch) != NoError || !batch->feature_done[0]) {
+    return_defer(Error);
+  }
+  const f32* query = batch->features;
+
+  f64 mean[FEATURE_DIMS] = {0};
+  f64 deviation[FEATURE_DIMS] = {0};
+  for (u32 i = 0; i < header->count; ++i) {
+    for (u32 d = 0; d < FEATURE_DIMS; ++d) {
+      mean[d] += records[i].features[d];
+    }
+  }
+  for (u32 d = 0; d < FEATURE_DIMS && header->count; ++d) {
+    mean[d] /= header->count;
+  }
+  for (u32 i = 0; i < header->count; ++i) {
+    for (u32 d = 0; d < FEATURE_DIMS; ++d) {
+      deviation[d] += (records[i].features[d] - mean[d]) * (records[i].features[d] - mean[d]);
+    }
+  }
+  for (u32 d = 0; d < FEATURE_DIMS; ++d) {
+    deviation[d] = header->count ? sqrt(deviation[d] / header->count) : 0.0;
+    if (deviation[d] < 1e-6) {
+      deviation[d] = 1.0;
+    }
+  }
+
+  neighbours = malloc((header->count ? header->count : 1) * sizeof(Neighbour));
+  if (!neighbours) {
+    return_defer(Error);
+  }
+  for (u32 i = 0; i < header->count; ++i) {
+    f64 distance = 0.0;
+    for (u32 d = 0; d < FEATURE_DIMS; ++d) {
+      const f64 delta = (records[i].features[d] - query[d]) / deviation[d];
+      distance += delta * delta;
+    }
+    neighbours[i].distance = sqrt(distance);
+    neighbours[i].index = i;
+  }
+  qsort(neighbours, header->count, sizeof(Neighbour), neighbour_compare);
+  const u32 count = (u32)CLAMP(g_neighbours, 0, (i32)header->count);
+  for (u32 i = 0; i < count; ++i) {
+    const Feature_record* record = &records[neighbours[i].index];
+    if (record->name_offset + (u64)record->name_length < header->names_size) {
+      fprintf(stdout, "%8.4f  %.*s\n", neighbours[i].distance, (i32)record->name_length, &names[record->name_offset]);
+    }
+  }
+defer:
+  free(neighbours);
+  if (header != MAP_FAILED) {
+    munmap((void*)header, map_size);
+  }
+  batch_free(batch);
+  return result;
+}
+
+i32 neighbour_compare(const void* a, const void* b) {
+  const f64 x = ((const Neighbour*)a)->distance;
+  const f64 y = ((const Neighbour*)b)->distance;
+  return (x > y) - (x < y);
+}
+
+// Frames that fit in the mix bus. When the host decides the buffer size, callbacks
+// may ask for any number of frames, so they are handled in chunks of this size.
+u32 binplay_buffer_frames() {
+  if (g_frames_per_buffer > 0) {
+    return g_frames_per_buffer;
+  }
+  return MAX_FRAMES_PER_BUFFER;
+}
+
+i32 binplay_process_audio(void* output, u32 frame_count) {
   Binplay* b = &binplay;
   i16* buffer = (i16*)output;
+  RT_AUDIO_PATH_BEGIN();
+  const u64 start_ns = clock_ns(CLOCK_MONOTONIC);
+  const u32 total_frames = frame_count;
+  const u32 channel_count = g_channel_count;
+  Source* primary = &b->sources[0];
+  f32 peak[METER_CHANNELS] = {0};
+  f32 sum_squares[METER_CHANNELS] = {0};
+  u32 clips[METER_CHANNELS] = {0};
 
-  i16* file_buffer = (i16*)b->output;
-  if (b->play) {
-    const u32 bytes_to_read = g_frames_per_buffer * g_sample_size * g_channel_count;
-    fseek(b->fp, b->file_cursor, SEEK_SET);
-    u32 bytes_read = fread(file_buffer, 1, bytes_to_read, b->fp);
-    for (u32 i = 0; i < g_frames_per_buffer * g_channel_count; ++i) {
-      *buffer++ = (i16)(g_volume * file_buffer[i]);
-    }
-    b->file_cursor += g_frames_per_buffer * g_sample_size * g_channel_count;
-    if (bytes_read < bytes_to_read || b->file_cursor >= b->file_size) {
-      if (g_loop_after_complete) {
-        b->file_cursor = b->file_cursor_start_pos;
+  const u32 gen = primary->gen;
+  binplay_apply_commands(b);
+  Audio_state* audio = &b->audio;
+  const f32 volume = audio->volume;
+  const u8 played = audio->play;
+
+  f32* bus = (f32*)b->output;
+  const u32 buffer_frames = binplay_buffer_frames();
+  while (frame_count > 0) {
+    const u32 frames = frame_count < buffer_frames ? frame_count : buffer_frames;
+    const u32 sample_count = frames * g_channel_count;
+    frame_count -= frames;
+    if (audio->play) {
+      memset(bus, 0, sample_count * sizeof(f32));
+      const u8 loop = audio->loop || audio->region;
+      u8 ended = source_mix(primary, bus, frames, loop);
+      for (u32 i = 1; i < b->source_count; ++i) {
+        source_mix(&b->sources[i], bus, frames, loop);
       }
-      else {
-        b->file_cursor = b->file_size;
-        b->play = 0;
+      // Levels are taken from the same pass that converts the bus to the output format
+      u32 channel = 0;
+      for (u32 i = 0; i < sample_count; ++i) {
+        f32 sample = volume * bus[i] * 32768.0f;
+        if (channel < METER_CHANNELS) {
+          f32 magnitude = fabsf(sample);
+          peak[channel] = magnitude > peak[channel] ? magnitude : peak[channel];
+          sum_squares[channel] += sample * sample;
+          clips[channel] += magnitude >= 32768.0f;
+        }
+        channel = channel + 1 == channel_count ? 0 : channel + 1;
+        sample = CLAMP(sample, -32768.0f, 32767.0f);
+        *buffer++ = (i16)sample;
+      }
+      spectrogram_tap(&b->spectrogram, bus, frames, volume);
+      if (ended) {
+        primary->cursor = primary->file_size;
+        audio->play = 0;
+        binplay_notify_ui(b);
       }
-      return NoError;
     }
-  }
-  else {
-    for (u32 i = 0; i < g_frames_per_buffer * g_channel_count; ++i) {
-      *buffer++ = 0;
+    else {
+      for (u32 i = 0; i < sample_count; ++i) {
+        *buffer++ = 0;
+      }
     }
   }
+  level_meters_publish(&b->meters, peak, sum_squares, clips, total_frames);
+  play_position_publish(&b->position, primary->cursor, atomic_load_explicit(&primary->tail, memory_order_relaxed), primary->synced_gen == primary->gen && primary->prefix_used == primary->prefix_size, audio);
+  // After the publish, so that the ui sees the new position once the reader forwarded the event.
+  // A paused player with nothing to tell leaves the reader asleep.
+  if (played || primary->gen != gen || atomic_load_explicit(&b->ui_dirty, memory_order_relaxed)) {
+    binplay_wake_workers(b);
+  }
+  profile_record(&b->profile, clock_ns(CLOCK_MONOTONIC) - start_ns, total_frames);
+  RT_AUDIO_PATH_END();
   return NoError;
 }
 
 void binplay_exit(Binplay* b) {
-  fclose(b->fp);
-  free(b->output);
-  b->output_size = 0;
+  RT_STEADY_STATE_END();
+  atomic_store(&b->done, 1);
+  if (b->writer_running) {
+    pthread_join(b->writer, NULL);
+    b->writer_running = 0;
+  }
+  // Stop the audio thread before the buffers it reads from go away
   Pa_CloseStream(stream);
+  stream = NULL;
+  if (b->reader_running) {
+    binplay_wake_workers(b);
+    pthread_join(b->reader, NULL);
+    b->reader_running = 0;
+  }
+  if (b->waveform.worker_running) {
+    pthread_join(b->waveform.worker, NULL);
+    b->waveform.worker_running = 0;
+  }
+  if (b->spectrogram.worker_running) {
+    pthread_join(b->spectrogram.worker, NULL);
+    b->spectrogram.worker_running = 0;
+  }
+  block_index_stop(b);
+  analysis_cache_close(b);
+  control_stop(b);
+  cue_free(b);
+  prefetch_stop(b);
+  for (u32 i = 0; i < b->source_count; ++i) {
+    source_close(&b->sources[i]);
+  }
+  b->source_count = 0;
+  b->output = NULL;
+  b->output_size = 0;
+  b->write_buffer = NULL;
+  arena_free(&b->arena);
+  if (b->event_fd >= 0) {
+    close(b->event_fd);
+    b->event_fd = -1;
+  }
   Pa_Terminate();
-  tg_free();
-  tg_print_error();
+  if (!g_headless) {
+    tg_free();
+    tg_print_error();
+  }
+
+  // Summary goes out after termgui has restored the terminal
+  char xruns[MAX_XRUN_EVENTS * 32] = {0};
+  xrun_format(&b->xruns, xruns, sizeof(xruns), MAX_XRUN_EVENTS);
+  fprintf(stderr, "%s: xruns: %s\n", PROG, xruns);
+#ifdef DEBUG
+  if (atomic_load(&rt_violations)) {
+    fprintf(stderr, "%s: %u calls to malloc/free or blocking syscalls from the audio path (last: %s)\n", PROG, atomic_load(&rt_violations), atomic_load(&rt_violation_name));
+  }
+  if (atomic_load(&rt_steady_allocations)) {
+    fprintf(stderr, "%s: %u allocations after playback started\n", PROG, atomic_load(&rt_steady_allocations));
+  }
+#endif
+  if (g_profile_path) {
+    profile_write_json(&b->profile, g_profile_path);
+  }
 }
 
 void on_update_event(Element* e, void* userdata) {
@@ -444,8 +6330,16 @@ void on_update_event(Element* e, void* userdata) {
   Binplay* b = (Binplay*)userdata;
   if (b->time_elapsed >= 1.0f) {
     b->time_elapsed = 0.0;
-    display_info(b);
-    vm_push_ins(I_RENDER_EVENT);
+    u8 changed = display_info(b);
+    changed |= waveform_render(b);
+    changed |= spectrogram_render(b);
+    changed |= hex_view_render(b);
+    changed |= block_index_render(b);
+    changed |= level_meters_render(b);
+    changed |= cue_list_render(b);
+    if (changed) {
+      vm_push_ins(I_RENDER_EVENT);
+    }
   }
 }
 
@@ -454,27 +6348,70 @@ void on_input_event(Element* e, void* userdata, const char* input, u32 size) {
     return;
   }
   Binplay* b = (Binplay*)userdata;
+  Command command = { .type = CommandNone, };
   switch (*input) {
     case KeyTogglePause: {
-      b->play = !b->play;
+      command.type = CommandTogglePause;
       break;
     }
     case KeyToggleLoop: {
-      g_loop_after_complete = !g_loop_after_complete;
+      command.type = CommandLoop;
+      command.amount = -1;
       break;
     }
     case KeyReset: {
-      b->file_cursor = 0;
+      command.type = CommandSeek;
+      command.offset = 0;
       break;
     }
     case KeyEnd: {
-      b->file_cursor = b->file_size;
+      command.type = CommandSeek;
+      command.offset = b->file_size;
       break;
     }
     case KeyToggleHelp: {
       b->show_help = !b->show_help;
       break;
     }
+    case KeyNextHighEntropy: {
+      command.type = CommandJump;
+      command.offset = BlockHighEntropy;
+      break;
+    }
+    case KeyNextLowEntropy: {
+      command.type = CommandJump;
+      command.offset = BlockLowEntropy;
+      break;
+    }
+    case KeyNextText: {
+      command.type = CommandJump;
+      command.offset = BlockText;
+      break;
+    }
+    case KeySetCue: {
+      command.type = CommandSetCue;
+      break;
+    }
+    case KeyMarkA:
+    case KeyMarkB: {
+      // The audio thread only loops once both markers are set, with A before B
+      command.type = CommandRegion;
+      command.offset = *input == KeyMarkA ? binplay_cursor(b) : b->marker_a;
+      command.end = *input == KeyMarkB ? binplay_cursor(b) : b->marker_b;
+      break;
+    }
+    case KeyClearMarks: {
+      command.type = CommandRegion;
+      command.offset = -1;
+      command.end = -1;
+      break;
+    }
+    case '1': case '2': case '3': case '4': case '5':
+    case '6': case '7': case '8': case '9': case '0': {
+      command.type = CommandCue;
+      command.offset = *input == '0' ? MAX_CUES - 1 : *input - '1';
+      break;
+    }
     case 27: {
       if (size == 3) {
         ++input;
@@ -482,23 +6419,24 @@ void on_input_event(Element* e, void* userdata, const char* input, u32 size) {
           ++input;
           // Left arrow
           if (*input == 68) {
-            b->file_cursor -= g_cursor_speed;
+            command.type = CommandSeekBy;
+            command.offset = -g_cursor_speed;
           }
           // Right arrow
           else if (*input == 67) {
-            b->file_cursor += g_cursor_speed;
+            command.type = CommandSeekBy;
+            command.offset = g_cursor_speed;
           }
-          b->file_cursor = CLAMP(b->file_cursor, 0, (i32)b->file_size);
-
           // Down arrow
-          if (*input == 65) {
-            g_volume += 0.05f;
+          else if (*input == 65) {
+            command.type = CommandVolumeBy;
+            command.amount = 0.05f;
           }
           // Up arrow
           else if (*input == 66) {
-            g_volume -= 0.05f;
+            command.type = CommandVolumeBy;
+            command.amount = -0.05f;
           }
-          g_volume = CLAMP(g_volume, 0.0f, 1.0f);
         }
       }
       break;
@@ -506,5 +6444,10 @@ void on_input_event(Element* e, void* userdata, const char* input, u32 size) {
     default:
       break;
   }
+  binplay_command(b, &command);
   display_info(b);
+  waveform_render(b);
+  hex_view_render(b);
+  block_index_render(b);
+  cue_list_render(b);
 }
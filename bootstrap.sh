@@ -2,4 +2,4 @@
 
 set -xe
 
-gcc binplay.c -o binplay -lportaudio -Wall -O3
+gcc binplay.c -o binplay -lportaudio -lpthread -lm -Wall -O3